@@ -0,0 +1,119 @@
+# ============================================================================
+#  vSMC/cmake/vSMCOpenCLCompile.cmake
+# ----------------------------------------------------------------------------
+#                          vSMC: Scalable Monte Carlo
+# ----------------------------------------------------------------------------
+#  Copyright (c) 2013-2015, Yan Zhou
+#  All rights reserved.
+#
+#  Redistribution and use in source and binary forms, with or without
+#  modification, are permitted provided that the following conditions are met:
+#
+#    Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+#
+#    Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+#
+#  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+#  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+#  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+#  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+#  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+#  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+#  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+#  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+#  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+#  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+#  POSSIBILITY OF SUCH DAMAGE.
+# ============================================================================
+
+# Compile OpenCL programs for StateCL ahead of time
+#
+# This module requires FindOpenCL. It provides the function
+#
+# VSMC_OPENCL_COMPILE(<target> <source>
+#     [OUTPUT <directory>]
+#     [SIZE <number of particles>]
+#     [STATE_SIZE <state size in bytes>]
+#     [FP_TYPE <float|double>]
+#     [SEED <seed>]
+#     [DEVICE_TYPE <CPU|GPU|ACCELERATOR|ALL>]
+#     [DESTINATION <install directory>]
+#     [OPTIONS <OpenCL compiler options>...])
+#
+# which adds a target `<target>` that builds `<source>` for each device of
+# `DEVICE_TYPE` (default ALL) found at build time, and writes the binaries
+# to `OUTPUT` (default ${CMAKE_CURRENT_BINARY_DIR}/<target>). If
+# `DESTINATION` is given, the binaries are also installed there.
+#
+# `SIZE`, `STATE_SIZE`, `FP_TYPE` (default float), `SEED` (default the
+# default seed of vSMC) and `OPTIONS` shall be the same as the StateCL object
+# and the flags passed to `StateCL::build(source, flags, binary_dir)` at
+# runtime, where `binary_dir` is the output or install directory. Otherwise,
+# or if the runtime devices or drivers differ, StateCL builds from source.
+#
+# The compiler is the host program `vsmc_cl_compile`, built from
+# vSMCOpenCLCompile.cpp. The vSMC include directories shall be set before
+# the function is called.
+
+IF (COMMAND VSMC_OPENCL_COMPILE)
+    RETURN()
+ENDIF (COMMAND VSMC_OPENCL_COMPILE)
+
+INCLUDE(CMakeParseArguments)
+SET(VSMC_OPENCL_COMPILE_SOURCE ${CMAKE_CURRENT_LIST_DIR}/vSMCOpenCLCompile.cpp
+    CACHE INTERNAL "Source of vsmc_cl_compile")
+
+FUNCTION(VSMC_OPENCL_COMPILE target source)
+    CMAKE_PARSE_ARGUMENTS(VSMC_CLC ""
+        "OUTPUT;SIZE;STATE_SIZE;FP_TYPE;SEED;DEVICE_TYPE;DESTINATION"
+        "OPTIONS" ${ARGN})
+    IF (NOT OPENCL_FOUND)
+        MESSAGE(STATUS "OpenCL not found, ${target} not added")
+        RETURN()
+    ENDIF (NOT OPENCL_FOUND)
+    IF (NOT VSMC_CLC_SIZE OR NOT VSMC_CLC_STATE_SIZE)
+        MESSAGE(FATAL_ERROR
+            "VSMC_OPENCL_COMPILE: SIZE and STATE_SIZE are required")
+    ENDIF (NOT VSMC_CLC_SIZE OR NOT VSMC_CLC_STATE_SIZE)
+    IF (NOT VSMC_CLC_OUTPUT)
+        SET(VSMC_CLC_OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/${target})
+    ENDIF (NOT VSMC_CLC_OUTPUT)
+    IF (NOT VSMC_CLC_FP_TYPE)
+        SET(VSMC_CLC_FP_TYPE float)
+    ENDIF (NOT VSMC_CLC_FP_TYPE)
+    IF (NOT VSMC_CLC_SEED)
+        SET(VSMC_CLC_SEED default)
+    ENDIF (NOT VSMC_CLC_SEED)
+    IF (NOT VSMC_CLC_DEVICE_TYPE)
+        SET(VSMC_CLC_DEVICE_TYPE ALL)
+    ENDIF (NOT VSMC_CLC_DEVICE_TYPE)
+    GET_FILENAME_COMPONENT(source ${source} ABSOLUTE)
+
+    IF (NOT TARGET vsmc_cl_compile)
+        ADD_EXECUTABLE(vsmc_cl_compile ${VSMC_OPENCL_COMPILE_SOURCE})
+        SET_TARGET_PROPERTIES(vsmc_cl_compile PROPERTIES
+            COMPILE_DEFINITIONS "${OpenCL_DEFINITIONS}")
+        TARGET_INCLUDE_DIRECTORIES(vsmc_cl_compile
+            PRIVATE ${OpenCL_INCLUDE_DIR})
+        TARGET_LINK_LIBRARIES(vsmc_cl_compile ${OpenCL_LINK_LIBRARIES})
+    ENDIF (NOT TARGET vsmc_cl_compile)
+
+    SET(stamp ${CMAKE_CURRENT_BINARY_DIR}/${target}.stamp)
+    ADD_CUSTOM_COMMAND(OUTPUT ${stamp}
+        COMMAND ${CMAKE_COMMAND} -E make_directory ${VSMC_CLC_OUTPUT}
+        COMMAND vsmc_cl_compile ${VSMC_CLC_OUTPUT} ${source}
+        ${VSMC_CLC_SIZE} ${VSMC_CLC_STATE_SIZE} ${VSMC_CLC_FP_TYPE}
+        ${VSMC_CLC_SEED} ${VSMC_CLC_DEVICE_TYPE} ${VSMC_CLC_OPTIONS}
+        COMMAND ${CMAKE_COMMAND} -E touch ${stamp}
+        DEPENDS vsmc_cl_compile ${source}
+        COMMENT "Compiling OpenCL program ${source}")
+    ADD_CUSTOM_TARGET(${target} ALL DEPENDS ${stamp})
+
+    IF (VSMC_CLC_DESTINATION)
+        INSTALL(DIRECTORY ${VSMC_CLC_OUTPUT}/
+            DESTINATION ${VSMC_CLC_DESTINATION})
+    ENDIF (VSMC_CLC_DESTINATION)
+ENDFUNCTION(VSMC_OPENCL_COMPILE)
@@ -0,0 +1,139 @@
+//============================================================================
+// vSMC/cmake/vSMCOpenCLCompile.cpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+// Compile an OpenCL program for StateCL ahead of time
+//
+// Usage: vsmc_cl_compile <output directory> <source file> <size>
+//     <state size> <float|double> <seed|default> <CPU|GPU|ACCELERATOR|ALL>
+//     [options...]
+//
+// The source is prefixed with the same macros as StateCL::build, and built
+// for each device of the given type on all platforms. The binaries are
+// written to the output directory in the format of CLProgramCache, which
+// StateCL::build(source, flags, binary_dir) searches first.
+
+#include <vsmc/opencl/backend_cl.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+template <typename RealType>
+inline int vsmc_cl_compile(const std::string &dir, const std::string &source,
+    std::size_t size, std::size_t state_size, std::size_t seed,
+    ::cl_device_type dev_type, const std::string &options)
+{
+    const std::string src(
+        vsmc::internal::cl_source_macros<RealType>(size, state_size, seed) +
+        source);
+    vsmc::CLProgramCache<> &cache = vsmc::CLProgramCache<>::instance();
+    cache.directory(dir);
+
+    int built = 0;
+    for (const auto &plat : vsmc::CLPlatform::platforms()) {
+        for (const auto &dev : plat.get_device(dev_type)) {
+            std::string name;
+            dev.get_info(CL_DEVICE_NAME, name);
+            ::cl_context_properties properties[] = {CL_CONTEXT_PLATFORM,
+                reinterpret_cast<::cl_context_properties>(plat.get()), 0};
+            vsmc::CLContext ctx(
+                properties, std::vector<vsmc::CLDevice>(1, dev));
+            vsmc::CLCommandQueue cmd(ctx, dev, 0);
+            if (!bool(ctx) || !bool(cmd))
+                continue;
+            vsmc::CLManager<>::instance().setup(plat, ctx, dev, cmd);
+
+            ::cl_int status = CL_SUCCESS;
+            vsmc::CLProgram program(cache.build(src, options, status));
+            if (status == CL_SUCCESS) {
+                std::cout << "Compiled for " << name << ": "
+                          << cache.file_name(src, options) << std::endl;
+                ++built;
+            } else {
+                std::cout << "Failed to compile for " << name << std::endl;
+                std::cout << program.build_log(dev) << std::endl;
+            }
+        }
+    }
+
+    return built == 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 8) {
+        std::cout << "Usage: " << argv[0] << " <output directory>"
+                  << " <source file> <size> <state size> <float|double>"
+                  << " <seed|default> <CPU|GPU|ACCELERATOR|ALL>"
+                  << " [options...]" << std::endl;
+        return -1;
+    }
+
+    std::ifstream src_file(argv[2]);
+    if (!src_file) {
+        std::cout << "Failed to open " << argv[2] << std::endl;
+        return -1;
+    }
+    std::string source((std::istreambuf_iterator<char>(src_file)),
+        (std::istreambuf_iterator<char>()));
+
+    const std::size_t size = std::strtoul(argv[3], nullptr, 10);
+    const std::size_t state_size = std::strtoul(argv[4], nullptr, 10);
+    const std::string fp_type(argv[5]);
+    const std::string seed_str(argv[6]);
+    const std::size_t seed = seed_str == "default" ?
+        static_cast<std::size_t>(vsmc::Seed::instance().get()) :
+        std::strtoul(argv[6], nullptr, 10);
+
+    const std::string type(argv[7]);
+    ::cl_device_type dev_type = CL_DEVICE_TYPE_ALL;
+    if (type == "CPU")
+        dev_type = CL_DEVICE_TYPE_CPU;
+    else if (type == "GPU")
+        dev_type = CL_DEVICE_TYPE_GPU;
+    else if (type == "ACCELERATOR")
+        dev_type = CL_DEVICE_TYPE_ACCELERATOR;
+
+    std::string options;
+    for (int i = 8; i < argc; ++i) {
+        options += " ";
+        options += argv[i];
+    }
+
+    if (fp_type == "double") {
+        return vsmc_cl_compile<cl_double>(
+            argv[1], source, size, state_size, seed, dev_type, options);
+    }
+
+    return vsmc_cl_compile<cl_float>(
+        argv[1], source, size, state_size, seed, dev_type, options);
+}
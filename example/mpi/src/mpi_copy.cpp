@@ -0,0 +1,271 @@
+//============================================================================
+// vSMC/example/mpi/src/mpi_copy.cpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+// Scaling benchmark of WeightMPI and StateMPI::copy
+//
+// Usage: mpi_copy <output file> [repeat]
+//
+// Each run sweeps the number of particles, the size of each state and the
+// degeneracy of weights, at the number of ranks the program is launched
+// with. Both strong scaling (fixed total number of particles) and weak
+// scaling (fixed number of particles per rank) are measured. One line of
+// comma separated values is appended to the output file for each
+// configuration, such that runs with different numbers of ranks can be
+// collected into a single file and compared.
+
+#ifndef VSMC_MPI_PROFILE
+#define VSMC_MPI_PROFILE 1
+#endif
+
+#include <vsmc/mpi/mpi.hpp>
+#include <vsmc/core/particle.hpp>
+#include <fstream>
+#include <random>
+
+class bench_state
+{
+    public:
+    using size_type = std::size_t;
+    using state_pack_type = vsmc::Vector<char>;
+
+    explicit bench_state(size_type N)
+        : size_(N), state_size_(state_size()), data_(N * state_size_)
+    {
+        for (std::size_t i = 0; i != data_.size(); ++i)
+            data_[i] = static_cast<char>(i);
+    }
+
+    /// \brief The number of bytes of each state of new objects
+    static std::size_t &state_size()
+    {
+        static std::size_t size = 8;
+
+        return size;
+    }
+
+    size_type size() const { return size_; }
+
+    template <typename IntType>
+    void copy(size_type N, const IntType *src_idx)
+    {
+        for (size_type dst = 0; dst != N; ++dst) {
+            size_type src = static_cast<size_type>(src_idx[dst]);
+            if (src != dst) {
+                std::memcpy(data_.data() + dst * state_size_,
+                    data_.data() + src * state_size_, state_size_);
+            }
+        }
+    }
+
+    state_pack_type state_pack(size_type id) const
+    {
+        state_pack_type pack(state_size_);
+        std::memcpy(pack.data(), data_.data() + id * state_size_, state_size_);
+
+        return pack;
+    }
+
+    void state_unpack(size_type id, const state_pack_type &pack)
+    {
+        std::memcpy(data_.data() + id * state_size_, pack.data(), state_size_);
+    }
+
+    private:
+    size_type size_;
+    std::size_t state_size_;
+    vsmc::Vector<char> data_;
+};
+
+using bench_mpi = vsmc::StateMPI<bench_state>;
+
+enum bench_profile { Uniform, Mild, Skewed, Degenerate };
+
+static const char *bench_profile_name[] = {
+    "Uniform", "Mild", "Skewed", "Degenerate"};
+
+// Log weights of local particles, drawn by global id such that the weights
+// do not depend on the number of ranks
+inline void bench_weight(
+    vsmc::Particle<bench_mpi> &particle, bench_profile profile)
+{
+    const std::size_t N = particle.size();
+    const std::size_t offset = particle.value().offset();
+    vsmc::Vector<double> w(N);
+    for (std::size_t i = 0; i != N; ++i) {
+        std::mt19937 eng(static_cast<std::mt19937::result_type>(offset + i));
+        std::normal_distribution<double> rnorm(0, 1);
+        switch (profile) {
+            case Uniform: w[i] = 0; break;
+            case Mild: w[i] = rnorm(eng); break;
+            case Skewed: w[i] = 5 * rnorm(eng); break;
+            case Degenerate: w[i] = offset + i == 0 ? 0 : -1000; break;
+        }
+    }
+    particle.weight().set_log(w.data());
+}
+
+// Systematic resampling on the root, and copy on all ranks
+inline void bench_resample(vsmc::Particle<bench_mpi> &particle,
+    vsmc::Vector<double> &weight, vsmc::Vector<std::size_t> &src_idx)
+{
+    const std::size_t G = particle.value().global_size();
+    weight.resize(G);
+    src_idx.resize(G);
+    particle.weight().read_resample_weight(weight.data());
+    if (particle.value().world().rank() == 0) {
+        double u = 0.5 / G;
+        double acc = weight[0];
+        std::size_t src = 0;
+        for (std::size_t dst = 0; dst != G; ++dst, u += 1.0 / G) {
+            while (acc < u && src != G - 1)
+                acc += weight[++src];
+            src_idx[dst] = src;
+        }
+    }
+    particle.value().copy(G, src_idx.data());
+}
+
+struct bench_result {
+    double time;
+    double copy;
+    std::size_t bytes;
+    std::size_t messages;
+};
+
+inline bench_result bench_run(std::size_t N, bench_profile profile,
+    std::size_t repeat, const boost::mpi::communicator &world)
+{
+    using profile_type = vsmc::MPIProfile<>;
+
+    vsmc::Particle<bench_mpi> particle(N);
+    vsmc::Vector<double> weight;
+    vsmc::Vector<std::size_t> src_idx;
+
+    profile_type::instance().clear();
+    double time = 0;
+    for (std::size_t r = 0; r != repeat; ++r) {
+        bench_weight(particle, profile);
+        world.barrier();
+        double start = MPI_Wtime();
+        bench_resample(particle, weight, src_idx);
+        time += MPI_Wtime() - start;
+    }
+
+    const profile_type &p = profile_type::instance();
+    double copy = 0;
+    std::size_t bytes = 0;
+    std::size_t messages = 0;
+    for (std::size_t i = 0; i != vsmc::MPIProfilePhaseNum; ++i) {
+        const vsmc::MPIProfileCounter &c =
+            p.counter(static_cast<vsmc::MPIProfilePhase>(i));
+        bytes += c.bytes;
+        messages += c.messages;
+    }
+    copy += p.counter(vsmc::MPIProfileCopyBroadcast).time;
+    copy += p.counter(vsmc::MPIProfileCopyPlacement).time;
+    copy += p.counter(vsmc::MPIProfileCopyThisNode).time;
+    copy += p.counter(vsmc::MPIProfileCopyInterNode).time;
+
+    bench_result result;
+    boost::mpi::reduce(
+        world, time, result.time, boost::mpi::maximum<double>(), 0);
+    boost::mpi::reduce(
+        world, copy, result.copy, boost::mpi::maximum<double>(), 0);
+    boost::mpi::reduce(world, bytes, result.bytes, std::plus<std::size_t>(), 0);
+    boost::mpi::reduce(
+        world, messages, result.messages, std::plus<std::size_t>(), 0);
+    result.time /= repeat;
+    result.copy /= repeat;
+    result.bytes /= repeat;
+    result.messages /= repeat;
+
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    vsmc::MPIEnvironment env(argc, argv);
+    boost::mpi::communicator world;
+
+    if (argc < 2) {
+        if (world.rank() == 0) {
+            std::cout << "Usage: " << argv[0] << " <output file>"
+                      << " <optional number of repeats>" << std::endl;
+        }
+        return -1;
+    }
+    const std::size_t repeat =
+        argc > 2 ? static_cast<std::size_t>(std::atoi(argv[2])) : 10;
+    const std::size_t R = static_cast<std::size_t>(world.size());
+
+    std::ofstream output;
+    if (world.rank() == 0) {
+        std::ifstream exist(argv[1]);
+        bool header = !exist.good() || exist.peek() == EOF;
+        exist.close();
+        output.open(argv[1], std::ios_base::app);
+        if (header) {
+            output << "Scaling,Ranks,ParticlesPerRank,Particles,StateSize,"
+                      "Profile,Repeat,TimePerResample,CopyTime,Bytes,"
+                      "Messages"
+                   << std::endl;
+        }
+    }
+
+    const std::size_t particle_num[] = {1000, 10000, 100000};
+    const std::size_t state_size[] = {8, 64, 512};
+    const bench_profile profile[] = {Uniform, Mild, Skewed, Degenerate};
+    for (std::size_t scaling = 0; scaling != 2; ++scaling) {
+        for (std::size_t n : particle_num) {
+            // Strong scaling distributes n particles, weak scaling has n
+            // particles on each rank
+            const std::size_t N = scaling == 0 ? (n + R - 1) / R : n;
+            for (std::size_t s : state_size) {
+                bench_state::state_size() = s;
+                for (bench_profile p : profile) {
+                    bench_result result = bench_run(N, p, repeat, world);
+                    if (world.rank() != 0)
+                        continue;
+                    output << (scaling == 0 ? "Strong" : "Weak") << ',';
+                    output << R << ',' << N << ',' << N * R << ',' << s;
+                    output << ',' << bench_profile_name[p] << ',' << repeat;
+                    output << ',' << result.time << ',' << result.copy;
+                    output << ',' << result.bytes << ',' << result.messages;
+                    output << std::endl;
+                }
+            }
+        }
+    }
+    if (world.rank() == 0)
+        output.close();
+
+    return 0;
+}
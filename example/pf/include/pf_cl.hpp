@@ -38,6 +38,8 @@
 
 #ifdef VSMC_PF_CL_MPI
 #include <vsmc/mpi/backend_mpi.hpp>
+#include <vsmc/mpi/mpi_io.hpp>
+#include <vsmc/mpi/mpi_shared.hpp>
 #endif
 
 #if VSMC_HAS_HDF5
@@ -59,6 +61,10 @@ using cv_base = vsmc::StateCL<StateSize, cl_float>;
 class cv : public cv_base
 {
     public:
+#ifndef VSMC_PF_CL_MPI
+    using weight_type = vsmc::WeightCL<cl_float>;
+#endif
+
     cv(size_type N) : cv_base(N) {}
 
     const vsmc::CLMemory &obs_x() const { return obs_x_.data(); }
@@ -69,22 +75,42 @@ class cv : public cv_base
         if (!file)
             return;
 
-        vsmc::Vector<cl_float> x(DataNum);
-        vsmc::Vector<cl_float> y(DataNum);
-        std::ifstream data(file);
-        for (std::size_t i = 0; i != DataNum; ++i)
-            data >> x[i] >> y[i];
-        data.close();
+#ifdef VSMC_PF_CL_MPI
+        // Only rank zero parses the file, and the data is shared by all
+        // ranks on each node, from which it is uploaded to the device
+        vsmc::Vector<cl_float> xy;
+        if (this->world().rank() == 0)
+            parse_data(file, xy);
+        vsmc::MPISharedData<cl_float> data;
+        data.assign(this->world(), xy.size(), xy.data());
+        const cl_float *x = data.data();
+        const cl_float *y = data.data() + DataNum;
+#else
+        vsmc::Vector<cl_float> xy;
+        parse_data(file, xy);
+        const cl_float *x = xy.data();
+        const cl_float *y = xy.data() + DataNum;
+#endif
 
         obs_x_.resize(DataNum);
         obs_y_.resize(DataNum);
-        manager().write_buffer(obs_x(), DataNum, x.data());
-        manager().write_buffer(obs_y(), DataNum, y.data());
+        manager().write_buffer(obs_x(), DataNum, x);
+        manager().write_buffer(obs_y(), DataNum, y);
     }
 
     private:
     vsmc::CLBuffer<cl_float> obs_x_;
     vsmc::CLBuffer<cl_float> obs_y_;
+
+    // Observations are stored as all x followed by all y
+    static void parse_data(const char *file, vsmc::Vector<cl_float> &xy)
+    {
+        xy.resize(DataNum * 2);
+        std::ifstream data(file);
+        for (std::size_t i = 0; i != DataNum; ++i)
+            data >> xy[i] >> xy[i + DataNum];
+        data.close();
+    }
 };
 
 class cv_init : public vsmc::InitializeCL<cv>
@@ -102,8 +128,8 @@ class cv_init : public vsmc::InitializeCL<cv>
 
     void eval_pre(vsmc::Particle<cv> &particle)
     {
-        w_.resize(particle.size());
-        w_buffer_.resize(particle.size());
+        w_buffer_.resize(
+            particle.size(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
 
         vsmc::cl_set_kernel_args(kernel(), kernel_args_offset(),
             w_buffer_.data(), particle.value().obs_x(),
@@ -112,13 +138,15 @@ class cv_init : public vsmc::InitializeCL<cv>
 
     void eval_post(vsmc::Particle<cv> &particle)
     {
-        particle.value().manager().read_buffer(
-            w_buffer_.data(), particle.size(), w_.data());
-        particle.weight().set_log(w_.data());
+#ifdef VSMC_PF_CL_MPI
+        auto w = w_buffer_.map(CL_MAP_READ);
+        particle.weight().set_log(w.data());
+#else
+        particle.weight().set_log(w_buffer_.data());
+#endif
     }
 
     private:
-    vsmc::Vector<cl_float> w_;
     vsmc::CLBuffer<cl_float> w_buffer_;
 };
 
@@ -132,8 +160,8 @@ class cv_move : public vsmc::MoveCL<cv>
 
     void eval_pre(std::size_t, vsmc::Particle<cv> &particle)
     {
-        w_.resize(particle.size());
-        w_buffer_.resize(particle.size());
+        w_buffer_.resize(
+            particle.size(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
 
         vsmc::cl_set_kernel_args(kernel(), kernel_args_offset(),
             w_buffer_.data(), particle.value().obs_x(),
@@ -142,19 +170,27 @@ class cv_move : public vsmc::MoveCL<cv>
 
     void eval_post(std::size_t, vsmc::Particle<cv> &particle)
     {
-        particle.value().manager().read_buffer(
-            w_buffer_.data(), particle.size(), w_.data());
-        particle.weight().add_log(w_.data());
+#ifdef VSMC_PF_CL_MPI
+        auto w = w_buffer_.map(CL_MAP_READ);
+        particle.weight().add_log(w.data());
+#else
+        particle.weight().add_log(w_buffer_.data());
+#endif
     }
 
     private:
-    vsmc::Vector<cl_float> w_;
     vsmc::CLBuffer<cl_float> w_buffer_;
 };
 
 class cv_est : public vsmc::MonitorEvalCL<cv>
 {
     public:
+#ifndef VSMC_PF_CL_MPI
+    // Weighted averages are computed on the device with the log weights of
+    // WeightCL, such that the weights are not read back by the Monitor
+    cv_est() : vsmc::MonitorEvalCL<cv>(true) {}
+#endif
+
     void eval_sp(std::size_t, std::string &kernel_name)
     {
         kernel_name = std::string("cv_est");
@@ -169,21 +205,29 @@ inline void cv_do(vsmc::Sampler<cv> &sampler, vsmc::ResampleScheme res,
     sampler.initialize(argv[1]);
     sampler.iterate(DataNum - 1);
 
-    std::stringstream ss;
 #ifdef VSMC_PF_CL_MPI
-    ss << name << ".r" << sampler.particle().value().world().rank();
-#else
-    ss << name;
+    // Monitor records are global estimates, only the root writes them
+    if (sampler.particle().value().world().rank() == 0) {
+#endif
+        std::string est_file_name(argv[2] + name + ".txt");
+        std::ofstream est_file;
+        est_file.open(est_file_name.c_str());
+        est_file << sampler << std::endl;
+        est_file.close();
+#ifdef VSMC_PF_CL_MPI
+    }
 #endif
-    std::string rname(ss.str());
-    std::string est_file_name(argv[2] + rname + ".txt");
-    std::ofstream est_file;
-    est_file.open(est_file_name.c_str());
-    est_file << sampler << std::endl;
-    est_file.close();
 
-#if VSMC_HAS_HDF5
-    vsmc::hdf5store(sampler, argv[2] + rname + ".h5", "Sampler");
+#ifdef VSMC_PF_CL_MPI
+    // Weights and states of all ranks are written to a single shared file,
+    // in the order of the global particle ids
+    vsmc::MPIFile snapshot(sampler.particle().value().world(),
+        argv[2] + name + ".bin", MPI_MODE_CREATE | MPI_MODE_WRONLY);
+    vsmc::mpi_write_weight(snapshot, sampler.particle());
+    vsmc::mpi_write_state(snapshot, sampler.particle());
+    snapshot.close();
+#elif VSMC_HAS_HDF5
+    vsmc::hdf5store(sampler, argv[2] + name + ".h5", "Sampler");
 #endif
 }
 
@@ -86,7 +86,6 @@ __kernel void cv_init(__global cv *state, __global ulong *accept,
 
     vsmc_philox4x32 rng;
     vsmc_philox4x32_init(&rng, SEED + i);
-    rng.ctr.v[1] = i;
 
     float4 r = normal01(&rng);
     sp.pos_x = r.x * sd_pos0;
@@ -115,7 +114,7 @@ __kernel void cv_move(ulong iter, __global cv *state, __global ulong *accept,
 
     vsmc_philox4x32 rng;
     vsmc_philox4x32_init(&rng, SEED + i);
-    rng.ctr.v[1] = i;
+    rng.ctr.v[1] = iter;
 
     float4 r = normal01(&rng);
     sp.pos_x += r.x * sd_pos + delta * sp.vel_x;
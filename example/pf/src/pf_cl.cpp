@@ -42,13 +42,17 @@ int main(int argc, char **argv)
 
 #ifdef VSMC_PF_CL_MPI
     vsmc::MPIEnvironment env(argc, argv);
-    boost::mpi::communicator world;
-    if (world.rank() == 0) {
-        if (vsmc::CLQuery::has_device<CL_DEVICE_TYPE_CPU>())
-            vsmc::CLManager<>::instance().setup(CL_DEVICE_TYPE_CPU);
-    } else {
-        if (vsmc::CLQuery::has_device<CL_DEVICE_TYPE_GPU>())
-            vsmc::CLManager<>::instance().setup(CL_DEVICE_TYPE_GPU);
+    env.seed_scheme(vsmc::MPISeedGlobal);
+    // Each rank on a node uses a distinct GPU, or a distinct partition of
+    // the CPU if there is no GPU
+    const std::size_t node_rank = static_cast<std::size_t>(env.node_rank());
+    const std::size_t node_size = static_cast<std::size_t>(env.node_size());
+    if (vsmc::CLQuery::has_device<CL_DEVICE_TYPE_GPU>()) {
+        vsmc::CLManager<>::instance().setup(
+            CL_DEVICE_TYPE_GPU, node_rank, node_size);
+    } else if (vsmc::CLQuery::has_device<CL_DEVICE_TYPE_CPU>()) {
+        vsmc::CLManager<>::instance().setup(
+            CL_DEVICE_TYPE_CPU, node_rank, node_size);
     }
 #endif
 
@@ -77,7 +81,15 @@ int main(int argc, char **argv)
     vsmc::CLManager<>::instance().device().get_info(CL_DEVICE_NAME, name);
     std::cout << "Using device: " << name << std::endl;
 
-    sampler.init(cv_init()).move(cv_move(), false).monitor("pos", 2, cv_est());
+#ifdef VSMC_PF_CL_MPI
+    sampler.init(cv_init())
+        .move(cv_move(), false)
+        .monitor("pos", 2, vsmc::MonitorEvalMPI<cv>(cv_est()), true);
+#else
+    sampler.init(cv_init())
+        .move(cv_move(), false)
+        .monitor("pos", 2, cv_est(), true);
+#endif
     sampler.monitor("pos").name(0) = "pos.x";
     sampler.monitor("pos").name(1) = "pos.y";
 
@@ -36,11 +36,17 @@
 #include <vsmc/core/weight.hpp>
 #include <vsmc/mpi/mpi_datatype.hpp>
 #include <vsmc/mpi/mpi_manager.hpp>
+#include <vsmc/mpi/mpi_profile.hpp>
 
 #define VSMC_RUNTIME_ASSERT_MPI_BACKEND_MPI_COPY_SIZE_MISMATCH                \
     VSMC_RUNTIME_ASSERT(                                                      \
         (N == global_size_), "**StateMPI::copy** SIZE MISMATCH")
 
+#define VSMC_RUNTIME_ASSERT_MPI_BACKEND_MPI_PATH_DIM                          \
+    VSMC_RUNTIME_ASSERT((dim == 2),                                           \
+        "**PathEvalMPI::operator()** USED WITH A MONITOR OF DIMENSION "       \
+        "OTHER THAN 2")
+
 namespace vsmc
 {
 
@@ -97,12 +103,16 @@ class WeightMPI : public WeightBase
 
     void gather_resample_weight() const
     {
+        internal::MPIProfileTimer<ID> timer(MPIProfileResampleGather);
         weight_.resize(this->size());
         this->read_weight(weight_.data());
+        timer.wait_start();
         if (world_.rank() == 0)
             ::boost::mpi::gather(world_, weight_, weight_all_, 0);
         else
             ::boost::mpi::gather(world_, weight_, 0);
+        timer.wait_stop();
+        timer.stop(weight_.size() * sizeof(double), 1);
     }
 
     double get_ess() const
@@ -110,9 +120,13 @@ class WeightMPI : public WeightBase
         const std::size_t N = static_cast<std::size_t>(this->size());
         const double *const wptr = this->data();
 
+        internal::MPIProfileTimer<ID> timer(MPIProfileWeightReduce);
         double less = dot(N, wptr, 1, wptr, 1);
         double gess = 0;
+        timer.wait_start();
         ::boost::mpi::all_reduce(world_, less, gess, std::plus<double>());
+        timer.wait_stop();
+        timer.stop(sizeof(double), 1);
 
         return 1 / gess;
     }
@@ -122,9 +136,13 @@ class WeightMPI : public WeightBase
         const std::size_t N = static_cast<std::size_t>(this->size());
         double *const wptr = this->mutable_data();
 
+        internal::MPIProfileTimer<ID> timer(MPIProfileWeightReduce);
         double lcoeff = std::accumulate(wptr, wptr + N, 0.0);
         double gcoeff = 0;
+        timer.wait_start();
         ::boost::mpi::all_reduce(world_, lcoeff, gcoeff, std::plus<double>());
+        timer.wait_stop();
+        timer.stop(sizeof(double), 1);
         gcoeff = 1 / gcoeff;
         mul(N, gcoeff, wptr, wptr);
     }
@@ -134,10 +152,14 @@ class WeightMPI : public WeightBase
         const std::size_t N = static_cast<std::size_t>(this->size());
         double *const wptr = this->mutable_data();
 
+        internal::MPIProfileTimer<ID> timer(MPIProfileWeightReduce);
         double lmax_weight = *(std::max_element(wptr, wptr + N));
         double gmax_weight = 0;
+        timer.wait_start();
         ::boost::mpi::all_reduce(
             world_, lmax_weight, gmax_weight, ::boost::mpi::maximum<double>());
+        timer.wait_stop();
+        timer.stop(sizeof(double), 1);
         for (std::size_t i = 0; i != N; ++i)
             wptr[i] -= gmax_weight;
     }
@@ -145,6 +167,20 @@ class WeightMPI : public WeightBase
 
 /// \brief Particle::value_type subtype using MPI
 /// \ingroup MPI
+///
+/// \details
+/// By default, after resampling the offspring of a particle are placed where
+/// `src_idx` says, and thus particles are scattered across ranks regardless
+/// of their states. Optionally, a placement function can be set, which
+/// computes a key for each local particle, such as a space-filling-curve
+/// index of its position. During `copy`, the keys of all particles are
+/// gathered to rank zero, and the offspring are reordered by the keys of
+/// their parents before they are distributed. Since all particles have
+/// equal weights after resampling, the reordering does not change the
+/// resampled system. Particles that are their own parents keep their slots,
+/// as the local copy is done in place and requires that every parent does
+/// so. Only the other offspring are reordered, and the ranges of keys owned
+/// by ranks become more contiguous as the system is resampled.
 template <typename StateBase, typename ID = MPIDefault>
 class StateMPI : public StateBase
 {
@@ -152,6 +188,9 @@ class StateMPI : public StateBase
     using size_type = SizeType<StateBase>;
     using weight_type = WeightMPI<WeightType<StateBase>, ID>;
     using mpi_id = ID;
+    using key_type = std::uint64_t;
+    using placement_type =
+        std::function<void(StateMPI<StateBase, ID> &, key_type *)>;
 
     explicit StateMPI(size_type N)
         : StateBase(N)
@@ -174,6 +213,7 @@ class StateMPI : public StateBase
             global_size_ += size_all_[i];
             size_equal_ = size_equal_ && N == size_all_[i];
         }
+        global_index_dispatch(has_global_index_<StateBase>());
     }
 
     /// \brief Copy particles
@@ -191,12 +231,28 @@ class StateMPI : public StateBase
         src_idx_.resize(N);
         if (world_.rank() == 0)
             std::copy(src_idx, src_idx + N, src_idx_.begin());
+        if (bool(placement_))
+            copy_placement();
+        internal::MPIProfileTimer<ID> timer(MPIProfileCopyBroadcast);
+        timer.wait_start();
         ::boost::mpi::broadcast(world_, src_idx_, 0);
+        timer.wait_stop();
+        timer.stop(static_cast<std::size_t>(N) * sizeof(size_type), 1);
         copy_this_node(N, src_idx_.data(), copy_recv_, copy_send_);
         copy_inter_node(copy_recv_, copy_send_);
         copy_post_dispatch(has_copy_post_<StateBase>());
     }
 
+    /// \brief Set the placement function
+    ///
+    /// \details
+    /// The function shall write the keys of all local particles into its
+    /// second argument. An empty function disables the placement.
+    void placement(const placement_type &key) { placement_ = key; }
+
+    /// \brief The placement function
+    const placement_type &placement() const { return placement_; }
+
     /// \brief A duplicated MPI communicator for this state value object
     const ::boost::mpi::communicator &world() const { return world_; }
 
@@ -257,6 +313,55 @@ class StateMPI : public StateBase
         return local_id + offset_;
     }
 
+    /// \brief Pack all local particles into a contiguous buffer of bytes
+    ///
+    /// \return The number of bytes of each particle
+    ///
+    /// \details
+    /// The packs returned by `state_pack` shall be of the same size for all
+    /// particles, and their elements shall be trivially copyable. For
+    /// example, Vector<char> of StateCL satisfies these requirements.
+    std::size_t state_pack_local(Vector<char> &buffer)
+    {
+        const size_type N = this->size();
+        if (N == 0) {
+            buffer.clear();
+            return 0;
+        }
+
+        copy_pre_dispatch(has_copy_pre_<StateBase>());
+        std::size_t bytes = 0;
+        for (size_type i = 0; i != N; ++i) {
+            pack_send_ = this->state_pack(i);
+            if (i == 0) {
+                bytes = pack_bytes(pack_send_);
+                buffer.resize(static_cast<std::size_t>(N) * bytes);
+            }
+            std::memcpy(buffer.data() + i * bytes, pack_send_.data(), bytes);
+        }
+        copy_post_dispatch(has_copy_post_<StateBase>());
+
+        return bytes;
+    }
+
+    /// \brief Unpack all local particles from a buffer written by
+    /// `state_pack_local`
+    void state_unpack_local(const char *buffer)
+    {
+        const size_type N = this->size();
+        if (N == 0)
+            return;
+
+        copy_pre_dispatch(has_copy_pre_<StateBase>());
+        for (size_type i = 0; i != N; ++i) {
+            pack_recv_ = this->state_pack(i);
+            const std::size_t bytes = pack_bytes(pack_recv_);
+            std::memcpy(pack_recv_.data(), buffer + i * bytes, bytes);
+            this->state_unpack(i, std::move(pack_recv_));
+        }
+        copy_post_dispatch(has_copy_post_<StateBase>());
+    }
+
     protected:
     /// \brief The MPI recv/send tag used by `copy_inter_node`
     int copy_tag() const { return copy_tag_; }
@@ -273,6 +378,7 @@ class StateMPI : public StateBase
     {
         using std::advance;
 
+        internal::MPIProfileTimer<ID> timer(MPIProfileCopyThisNode);
         const int rank_this = world_.rank();
 
         src_idx_this_.resize(this->size());
@@ -299,6 +405,7 @@ class StateMPI : public StateBase
                 copy_send.push_back(std::make_pair(rank_recv, id_send));
             }
         }
+        timer.stop(0, 0);
     }
 
     /// \brief Perform global copy
@@ -309,11 +416,16 @@ class StateMPI : public StateBase
         const std::vector<std::pair<int, size_type>> &copy_recv,
         const std::vector<std::pair<int, size_type>> &copy_send)
     {
+        internal::MPIProfileTimer<ID> timer(MPIProfileCopyInterNode);
+        std::size_t bytes = 0;
         const int rank_this = world_.rank();
         for (int r = 0; r != world_.size(); ++r) {
             if (rank_this == r) {
                 for (std::size_t i = 0; i != copy_recv.size(); ++i) {
+                    timer.wait_start();
                     world_.recv(copy_recv[i].first, copy_tag_, pack_recv_);
+                    timer.wait_stop();
+                    bytes += pack_bytes(pack_recv_);
                     this->state_unpack(
                         copy_recv[i].second, std::move(pack_recv_));
                 }
@@ -321,11 +433,15 @@ class StateMPI : public StateBase
                 for (std::size_t i = 0; i != copy_send.size(); ++i) {
                     if (copy_send[i].first == r) {
                         pack_send_ = this->state_pack(copy_send[i].second);
+                        bytes += pack_bytes(pack_send_);
+                        timer.wait_start();
                         world_.send(copy_send[i].first, copy_tag_, pack_send_);
+                        timer.wait_stop();
                     }
                 }
             }
         }
+        timer.stop(bytes, copy_recv.size() + copy_send.size());
     }
 
     private:
@@ -337,13 +453,70 @@ class StateMPI : public StateBase
     int copy_tag_;
     std::vector<size_type> src_idx_;
     std::vector<size_type> src_idx_this_;
+    std::vector<size_type> src_idx_moved_;
     std::vector<std::pair<int, size_type>> copy_recv_;
     std::vector<std::pair<int, size_type>> copy_send_;
     typename StateBase::state_pack_type pack_recv_;
     typename StateBase::state_pack_type pack_send_;
+    placement_type placement_;
+    std::vector<key_type> key_;
+    std::vector<key_type> key_global_;
+    std::vector<std::vector<key_type>> key_all_;
 
     VSMC_DEFINE_METHOD_CHECKER(copy_pre, void, ())
     VSMC_DEFINE_METHOD_CHECKER(copy_post, void, ())
+    VSMC_DEFINE_METHOD_CHECKER(global_index, void, (size_type, size_type))
+
+    void copy_placement()
+    {
+        internal::MPIProfileTimer<ID> timer(MPIProfileCopyPlacement);
+        key_.resize(this->size());
+        placement_(*this, key_.data());
+        timer.wait_start();
+        if (world_.rank() == 0)
+            ::boost::mpi::gather(world_, key_, key_all_, 0);
+        else
+            ::boost::mpi::gather(world_, key_, 0);
+        timer.wait_stop();
+
+        if (world_.rank() == 0) {
+            key_global_.clear();
+            for (const auto &k : key_all_)
+                key_global_.insert(key_global_.end(), k.begin(), k.end());
+            // Particles that are their own parents keep their slots, such
+            // that the sources of the in-place local copy and those packed by
+            // copy_inter_node are never overwritten. Only the parents of the
+            // other slots are placed by their keys
+            src_idx_moved_.clear();
+            for (std::size_t i = 0; i != src_idx_.size(); ++i) {
+                if (src_idx_[i] != i)
+                    src_idx_moved_.push_back(src_idx_[i]);
+            }
+            std::stable_sort(src_idx_moved_.begin(), src_idx_moved_.end(),
+                [this](size_type i, size_type j) {
+                    return key_global_[i] < key_global_[j];
+                });
+            auto moved = src_idx_moved_.begin();
+            for (std::size_t i = 0; i != src_idx_.size(); ++i) {
+                if (src_idx_[i] != i)
+                    src_idx_[i] = *moved++;
+            }
+        }
+        timer.stop(key_.size() * sizeof(key_type), 1);
+    }
+
+    template <typename PackType>
+    static std::size_t pack_bytes(const PackType &pack)
+    {
+        return pack.size() * sizeof(typename PackType::value_type);
+    }
+
+    void global_index_dispatch(std::true_type)
+    {
+        StateBase::global_index(offset_, global_size_);
+    }
+
+    void global_index_dispatch(std::false_type) {}
 
     void copy_pre_dispatch(std::true_type) { StateBase::copy_pre(); }
     void copy_pre_dispatch(std::false_type) {}
@@ -351,6 +524,195 @@ class StateMPI : public StateBase
     void copy_post_dispatch(std::false_type) {}
 }; // class StateMPI
 
+/// \brief Monitor<T>::eval_type subtype using MPI
+/// \ingroup MPI
+///
+/// \details
+/// Wrap a Monitor evaluation function such that the Monitor estimates
+/// integrals over the particles on all ranks. The wrapped function is
+/// evaluated on local particles as usual. The weighted sums of all
+/// dimensions, together with the sum of local weights, are combined across
+/// ranks with a single collective operation. The Monitor shall be set to
+/// record only, for example,
+/// ~~~{.cpp}
+/// sampler.monitor("pos", 2, vsmc::MonitorEvalMPI<T>(eval), true);
+/// ~~~
+/// The particle system shall use WeightMPI (or StateMPI), whose communicator
+/// is used for the reduction.
+template <typename T>
+class MonitorEvalMPI
+{
+    public:
+    using eval_type =
+        std::function<void(std::size_t, std::size_t, Particle<T> &, double *)>;
+
+    /// \brief Construct from a local evaluation function
+    ///
+    /// \param eval The function that evaluates the local particles, with the
+    /// same requirement as Monitor<T>::eval_type
+    /// \param root If it is non-negative, the estimates are only reduced to
+    /// the rank `root`, and results on other ranks are set to zero.
+    /// Otherwise all ranks get the estimates.
+    explicit MonitorEvalMPI(const eval_type &eval, int root = -1)
+        : eval_(eval), root_(root)
+    {
+    }
+
+    void operator()(
+        std::size_t iter, std::size_t dim, Particle<T> &particle, double *r)
+    {
+        const std::size_t N = static_cast<std::size_t>(particle.size());
+        buffer_.resize(N * dim);
+        weight_.resize(N);
+        eval_(iter, dim, particle, buffer_.data());
+        particle.weight().read_weight(weight_.data());
+
+        local_.resize(dim + 1);
+        global_.resize(dim + 1);
+        std::fill(local_.begin(), local_.end(), 0.0);
+        const double *bptr = buffer_.data();
+        for (std::size_t i = 0; i != N; ++i, bptr += dim) {
+            for (std::size_t d = 0; d != dim; ++d)
+                local_[d] += weight_[i] * bptr[d];
+            local_[dim] += weight_[i];
+        }
+
+        const ::boost::mpi::communicator &world = particle.weight().world();
+        const int n = static_cast<int>(dim + 1);
+        if (root_ < 0) {
+            ::boost::mpi::all_reduce(world, local_.data(), n, global_.data(),
+                std::plus<double>());
+        } else if (world.rank() == root_) {
+            ::boost::mpi::reduce(world, local_.data(), n, global_.data(),
+                std::plus<double>(), root_);
+        } else {
+            ::boost::mpi::reduce(
+                world, local_.data(), n, std::plus<double>(), root_);
+            std::fill(r, r + dim, 0.0);
+            return;
+        }
+
+        const double coeff = 1 / global_[dim];
+        for (std::size_t d = 0; d != dim; ++d)
+            r[d] = global_[d] * coeff;
+    }
+
+    private:
+    eval_type eval_;
+    int root_;
+    std::vector<double> buffer_;
+    std::vector<double> weight_;
+    std::vector<double> local_;
+    std::vector<double> global_;
+}; // class MonitorEvalMPI
+
+/// \brief Path sampling estimator using MPI
+/// \ingroup MPI
+///
+/// \details
+/// The core Path integrates over local particles only. This class wraps a
+/// Path evaluation function, with the same requirement as
+/// Path<T>::eval_type, and estimates the integrands over the particles on
+/// all ranks. Each iteration the local weighted sum of the integrand and the
+/// sum of local weights are combined across ranks with a single
+/// collective operation of two values, and the logarithm of the normalizing
+/// constant is updated with the trapezoid rule. The object is used as the
+/// evaluation function of a record only Monitor of dimension two, which
+/// records the integrand and the grid,
+/// ~~~{.cpp}
+/// vsmc::PathEvalMPI<T> path(eval);
+/// sampler.monitor("path", 2, path, true);
+/// // ...
+/// double lz = path.log_zconst();
+/// ~~~
+/// Copies of a PathEvalMPI object share the same estimates, such that the
+/// original object can be queried after a copy is given to the Monitor.
+/// The estimates are cleared at iteration zero, such that each run of the
+/// sampler starts a new estimate.
+template <typename T>
+class PathEvalMPI
+{
+    public:
+    using eval_type =
+        std::function<double(std::size_t, Particle<T> &, double *)>;
+
+    explicit PathEvalMPI(const eval_type &eval)
+        : eval_(eval), record_(std::make_shared<record_type>())
+    {
+    }
+
+    void operator()(
+        std::size_t iter, std::size_t dim, Particle<T> &particle, double *r)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_BACKEND_MPI_PATH_DIM;
+
+        if (iter == 0)
+            clear();
+
+        const std::size_t N = static_cast<std::size_t>(particle.size());
+        buffer_.resize(N);
+        weight_.resize(N);
+        const double grid = eval_(iter, particle, buffer_.data());
+        particle.weight().read_weight(weight_.data());
+
+        std::array<double, 2> local = {{0, 0}};
+        std::array<double, 2> global = {{0, 0}};
+        for (std::size_t i = 0; i != N; ++i) {
+            local[0] += weight_[i] * buffer_[i];
+            local[1] += weight_[i];
+        }
+        ::boost::mpi::all_reduce(particle.weight().world(), local.data(), 2,
+            global.data(), std::plus<double>());
+
+        const double integrand = global[0] / global[1];
+        if (record_->grid.size() != 0) {
+            record_->log_zconst += 0.5 * (grid - record_->grid.back()) *
+                (integrand + record_->integrand.back());
+        }
+        record_->integrand.push_back(integrand);
+        record_->grid.push_back(grid);
+        r[0] = integrand;
+        r[1] = grid;
+    }
+
+    /// \brief The number of iterations recorded
+    std::size_t iter_size() const { return record_->grid.size(); }
+
+    /// \brief The global integrand of a given iteration
+    double integrand(std::size_t iter) const
+    {
+        return record_->integrand[iter];
+    }
+
+    /// \brief The grid of a given iteration
+    double grid(std::size_t iter) const { return record_->grid[iter]; }
+
+    /// \brief The logarithm of the normalizing constant ratio estimate
+    double log_zconst() const { return record_->log_zconst; }
+
+    /// \brief Clear all records
+    void clear()
+    {
+        record_->integrand.clear();
+        record_->grid.clear();
+        record_->log_zconst = 0;
+    }
+
+    private:
+    struct record_type {
+        record_type() : log_zconst(0) {}
+
+        std::vector<double> integrand;
+        std::vector<double> grid;
+        double log_zconst;
+    }; // struct record_type
+
+    eval_type eval_;
+    std::shared_ptr<record_type> record_;
+    std::vector<double> buffer_;
+    std::vector<double> weight_;
+}; // class PathEvalMPI
+
 } // namespace vsmc
 
 #endif // VSMC_MPI_BACKEND_MPI_HPP
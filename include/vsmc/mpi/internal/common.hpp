@@ -34,6 +34,11 @@
 
 #include <vsmc/internal/common.hpp>
 #include <boost/mpi.hpp>
+#include <boost/serialization/vector.hpp>
+
+#ifndef VSMC_MPI_PROFILE
+#define VSMC_MPI_PROFILE 0
+#endif
 
 namespace vsmc
 {
@@ -42,6 +47,31 @@ namespace vsmc
 /// \ingroup MPI
 class MPIDefault;
 
+namespace internal
+{
+
+#if VSMC_NO_RUNTIME_ASSERT
+inline void mpi_error_check(int, const char *, const char *) {}
+#else
+inline void mpi_error_check(int status, const char *func, const char *mpif)
+{
+    if (status == MPI_SUCCESS)
+        return;
+
+    std::string msg("**");
+    msg += func;
+    msg += "** failure";
+    msg += "; MPI function: ";
+    msg += mpif;
+    msg += "; Error code: ";
+    msg += itos(status);
+
+    VSMC_RUNTIME_ASSERT((status == MPI_SUCCESS), msg.c_str());
+}
+#endif
+
+} // namespace vsmc::internal
+
 } // namespace vsmc
 
 #endif // VSMC_MPI_INTERNAL_COMMON_HPP
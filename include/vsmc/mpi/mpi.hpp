@@ -34,7 +34,11 @@
 
 #include <vsmc/internal/config.h>
 #include <vsmc/mpi/backend_mpi.hpp>
+#include <vsmc/mpi/mpi_checkpoint.hpp>
 #include <vsmc/mpi/mpi_datatype.hpp>
+#include <vsmc/mpi/mpi_io.hpp>
 #include <vsmc/mpi/mpi_manager.hpp>
+#include <vsmc/mpi/mpi_profile.hpp>
+#include <vsmc/mpi/mpi_shared.hpp>
 
 #endif // VSMC_MPI_MPI_HPP
@@ -0,0 +1,284 @@
+//============================================================================
+// vSMC/include/vsmc/mpi/mpi_checkpoint.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_MPI_MPI_CHECKPOINT_HPP
+#define VSMC_MPI_MPI_CHECKPOINT_HPP
+
+#include <vsmc/mpi/internal/common.hpp>
+#include <vsmc/mpi/backend_mpi.hpp>
+#include <vsmc/mpi/mpi_io.hpp>
+#include <vsmc/mpi/mpi_manager.hpp>
+#include <vsmc/rng/seed.hpp>
+#include <sstream>
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_HEADER                        \
+    VSMC_RUNTIME_WARNING(false,                                               \
+        "**mpi_restart** NOT A CHECKPOINT OF A COMPATIBLE VERSION")
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_GLOBAL_SIZE                   \
+    VSMC_RUNTIME_WARNING(false,                                               \
+        "**mpi_restart** TOTAL NUMBER OF PARTICLES DOES NOT MATCH")
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_STATE_SIZE                    \
+    VSMC_RUNTIME_WARNING(false,                                               \
+        "**mpi_restart** SIZE OF PARTICLE STATES DOES NOT MATCH")
+
+namespace vsmc
+{
+
+namespace internal
+{
+
+/// \brief The header of a checkpoint, 72 bytes
+///
+/// \details
+/// Fields are, in order, the magic number, the version, the number of
+/// ranks, the total number of particles, the number of bytes of each
+/// particle state, the iteration number, the number of bytes of each seed,
+/// whether all ranks share the same seed, and the alignment of sections
+/// used by the writer.
+using MPICheckpointHeader = std::array<std::uint64_t, 9>;
+
+static constexpr std::uint64_t MPICheckpointMagic = 0x54504B434D534356ULL;
+static constexpr std::uint64_t MPICheckpointVersion = 2;
+
+/// \brief The offsets of sections of a checkpoint that starts at `off`
+///
+/// \details
+/// The sections are aligned as recorded in the header, such that a
+/// checkpoint can be restarted from a file with a different alignment
+inline void mpi_checkpoint_offset(::MPI_Offset off,
+    const MPICheckpointHeader &header, ::MPI_Offset &off_seed,
+    ::MPI_Offset &off_weight, ::MPI_Offset &off_state, ::MPI_Offset &off_end)
+{
+    const ::MPI_Offset P = static_cast<::MPI_Offset>(header[2]);
+    const ::MPI_Offset G = static_cast<::MPI_Offset>(header[3]);
+    const ::MPI_Offset B = static_cast<::MPI_Offset>(header[4]);
+    const ::MPI_Offset S = static_cast<::MPI_Offset>(header[6]);
+    const ::MPI_Offset A =
+        header[8] == 0 ? 1 : static_cast<::MPI_Offset>(header[8]);
+
+    off_seed = off + static_cast<::MPI_Offset>(sizeof(MPICheckpointHeader));
+    off_weight = (off_seed + P * S + A - 1) / A * A;
+    off_state =
+        (off_weight + G * static_cast<::MPI_Offset>(sizeof(double)) + A - 1) /
+        A * A;
+    off_end = off_state + G * B;
+}
+
+} // namespace vsmc::internal
+
+/// \brief Write a checkpoint of a distributed particle system collectively
+/// \ingroup MPI
+///
+/// \param file A file opened for writing
+/// \param particle The particle system, whose value type is a StateMPI
+/// \param iter The iteration number to be recorded
+/// \param async If `true`, the weights and states are written behind,
+/// see MPIFile::iwrite_at
+///
+/// \return The offset where the checkpoint starts, to be passed to
+/// `mpi_restart`
+///
+/// \details
+/// The checkpoint starts at `file.offset()`, aligned to `file.alignment()`,
+/// and the offset of the file is advanced to the end of the checkpoint. It
+/// consists of a header, the seed of each rank, the weights and the packed
+/// states of all particles, in the order of the global particle ids. The
+/// weights and states sections are aligned, such that with the alignment
+/// set to the stripe size, each section is striped over the file system.
+/// The file can be restarted onto any number of ranks.
+template <typename T>
+inline ::MPI_Offset mpi_checkpoint(
+    MPIFile &file, Particle<T> &particle, std::size_t iter, bool async = true)
+{
+    const ::boost::mpi::communicator &world = file.world();
+
+    Vector<char> state;
+    std::size_t bytes = particle.value().state_pack_local(state);
+    ::boost::mpi::all_reduce(
+        world, bytes, bytes, ::boost::mpi::maximum<std::size_t>());
+    Vector<double> weight(static_cast<std::size_t>(particle.size()));
+    particle.weight().read_weight(weight.data());
+
+    // Seed::get advances the seed, which is restored such that taking a
+    // checkpoint does not change the rest of the run
+    std::stringstream seed_state;
+    seed_state << Seed::instance();
+    Seed::result_type seed(Seed::instance().get());
+    seed_state >> Seed::instance();
+    std::vector<Seed::result_type> seed_all;
+    ::boost::mpi::all_gather(world, seed, seed_all);
+    bool seed_equal = true;
+    for (const auto &s : seed_all)
+        seed_equal = seed_equal && s == seed_all.front();
+
+    internal::MPICheckpointHeader header;
+    header[0] = internal::MPICheckpointMagic;
+    header[1] = internal::MPICheckpointVersion;
+    header[2] = static_cast<std::uint64_t>(world.size());
+    header[3] = static_cast<std::uint64_t>(particle.value().global_size());
+    header[4] = static_cast<std::uint64_t>(bytes);
+    header[5] = static_cast<std::uint64_t>(iter);
+    header[6] = static_cast<std::uint64_t>(sizeof(Seed::result_type));
+    header[7] = seed_equal ? 1 : 0;
+    header[8] = static_cast<std::uint64_t>(file.alignment());
+
+    const ::MPI_Offset off = file.align(file.offset());
+    ::MPI_Offset off_seed = 0;
+    ::MPI_Offset off_weight = 0;
+    ::MPI_Offset off_state = 0;
+    ::MPI_Offset off_end = 0;
+    internal::mpi_checkpoint_offset(
+        off, header, off_seed, off_weight, off_state, off_end);
+
+    const ::MPI_Offset R = static_cast<::MPI_Offset>(world.rank());
+    const ::MPI_Offset O =
+        static_cast<::MPI_Offset>(particle.value().offset());
+    off_seed += R * static_cast<::MPI_Offset>(sizeof(Seed::result_type));
+    off_weight += O * static_cast<::MPI_Offset>(sizeof(double));
+    off_state += O * static_cast<::MPI_Offset>(bytes);
+    const std::size_t nheader = world.rank() == 0 ? header.size() : 0;
+    if (async) {
+        file.iwrite_at(off, nheader, header.data());
+        file.iwrite_at(off_seed, 1, &seed);
+        file.iwrite_at(off_weight, weight.size(), weight.data());
+        file.iwrite_at(off_state, state.size(), state.data());
+    } else {
+        file.write_at(off, nheader, header.data());
+        file.write_at(off_seed, 1, &seed);
+        file.write_at(off_weight, weight.size(), weight.data());
+        file.write_at(off_state, state.size(), state.data());
+    }
+    file.offset(off_end);
+
+    return off;
+}
+
+/// \brief Restart a distributed particle system from a checkpoint
+/// collectively
+/// \ingroup MPI
+///
+/// \param file A file opened for reading
+/// \param particle The particle system, whose value type is a StateMPI. The
+/// total number of particles shall be the same as the one checkpointed, but
+/// the number of ranks and the distribution of particles among them can
+/// differ
+/// \param iter The iteration number recorded
+/// \param off The offset returned by `mpi_checkpoint`
+///
+/// \return If the particle system is restored
+///
+/// \details
+/// Each rank reads the slice of weights and states of its own particles.
+/// The sections are located with the alignment recorded by the writer, and
+/// thus `file.alignment()` need not be the same as when checkpointing.
+/// The seed of each rank is restored if the number of ranks is unchanged.
+/// Otherwise, if all ranks shared the same seed (MPISeedGlobal), it is
+/// restored on all ranks, and new random streams keyed by the global
+/// particle id do not depend on the number of ranks. If not, the seed of
+/// rank zero is restored and made distinct on each rank as MPIEnvironment
+/// does. In all cases, the seeds obtained after the restart are different
+/// from those used before the checkpoint.
+///
+/// Only Seed is restored. The states of RNG engines already seeded, such
+/// as those of the Particle and of the resampling, and the `SEED` macro
+/// of programs already built by StateCL, are not. Therefore, the random
+/// streams after a restart are not the same as those of an uninterrupted
+/// run. A StateCL shall be built after `mpi_restart` to use the restored
+/// seed.
+template <typename T>
+inline bool mpi_restart(MPIFile &file, Particle<T> &particle,
+    std::size_t &iter, ::MPI_Offset off = 0)
+{
+    const ::boost::mpi::communicator &world = file.world();
+
+    internal::MPICheckpointHeader header;
+    file.read_at(off, header.size(), header.data());
+    if (header[0] != internal::MPICheckpointMagic ||
+        header[1] != internal::MPICheckpointVersion ||
+        header[6] != sizeof(Seed::result_type)) {
+        VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_HEADER;
+        return false;
+    }
+    if (header[3] != particle.value().global_size()) {
+        VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_GLOBAL_SIZE;
+        return false;
+    }
+
+    ::MPI_Offset off_seed = 0;
+    ::MPI_Offset off_weight = 0;
+    ::MPI_Offset off_state = 0;
+    ::MPI_Offset off_end = 0;
+    internal::mpi_checkpoint_offset(
+        off, header, off_seed, off_weight, off_state, off_end);
+
+    const std::size_t N = static_cast<std::size_t>(particle.size());
+    const std::size_t bytes = static_cast<std::size_t>(header[4]);
+    Vector<char> state;
+    std::size_t local_bytes = particle.value().state_pack_local(state);
+    ::boost::mpi::all_reduce(world, local_bytes, local_bytes,
+        ::boost::mpi::maximum<std::size_t>());
+    if (local_bytes != bytes) {
+        VSMC_RUNTIME_WARNING_MPI_MPI_CHECKPOINT_STATE_SIZE;
+        return false;
+    }
+
+    const ::MPI_Offset O =
+        static_cast<::MPI_Offset>(particle.value().offset());
+    Vector<double> weight(N);
+    file.read_at(off_weight + O * static_cast<::MPI_Offset>(sizeof(double)),
+        N, weight.data());
+    file.read_at(off_state + O * static_cast<::MPI_Offset>(bytes),
+        state.size(), state.data());
+    particle.weight().set(weight.data());
+    particle.value().state_unpack_local(state.data());
+
+    const bool same_size =
+        header[2] == static_cast<std::uint64_t>(world.size());
+    const ::MPI_Offset R = same_size ? world.rank() : 0;
+    Seed::result_type seed;
+    file.read_at(
+        off_seed + R * static_cast<::MPI_Offset>(sizeof(Seed::result_type)),
+        1, &seed);
+    if (!same_size && header[7] == 0)
+        internal::mpi_init_seed(seed, world.size(), world.rank());
+    Seed::instance().set(seed);
+
+    iter = static_cast<std::size_t>(header[5]);
+    file.offset(off_end);
+
+    return true;
+}
+
+} // namespace vsmc
+
+#endif // VSMC_MPI_MPI_CHECKPOINT_HPP
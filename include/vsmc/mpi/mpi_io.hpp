@@ -0,0 +1,486 @@
+//============================================================================
+// vSMC/include/vsmc/mpi/mpi_io.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_MPI_MPI_IO_HPP
+#define VSMC_MPI_MPI_IO_HPP
+
+#include <vsmc/mpi/internal/common.hpp>
+#include <vsmc/mpi/backend_mpi.hpp>
+#include <cstdint>
+#include <list>
+#include <utility>
+
+#define VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN                                   \
+    VSMC_RUNTIME_ASSERT((file_ != MPI_FILE_NULL),                             \
+        "**MPIFile** ATTEMPT TO ACCESS A FILE NOT OPENED")
+
+#define VSMC_RUNTIME_ASSERT_MPI_MPI_IO_COUNT(bytes)                           \
+    VSMC_RUNTIME_ASSERT((bytes <= static_cast<std::size_t>(                   \
+                                      std::numeric_limits<int>::max())),      \
+        "**MPIFile** BLOCK SIZE TOO LARGE FOR A SINGLE MPI-IO OPERATION")
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_IO_OPEN                                  \
+    VSMC_RUNTIME_WARNING(false, "**MPIFile::open** FAILED TO OPEN THE FILE")
+
+#if MPI_VERSION > 3 || (MPI_VERSION == 3 && MPI_SUBVERSION >= 1)
+#define VSMC_MPI_HAS_IWRITE_AT_ALL 1
+#else
+#define VSMC_MPI_HAS_IWRITE_AT_ALL 0
+#endif
+
+namespace vsmc
+{
+
+/// \brief Collective MPI-IO file
+/// \ingroup MPI
+///
+/// \details
+/// All ranks of a communicator write to a single shared file. Each
+/// collective write appends one block per rank, in the order of the ranks,
+/// at the end of the data written so far. The offsets are computed from the
+/// block sizes of all ranks, such that the data of each rank is contiguous.
+/// If `alignment()` is larger than one, the beginning of the block of each
+/// rank is aligned to it, for example, the stripe size of the file system.
+/// The gaps between blocks are then left as holes in the file.
+///
+/// Nonblocking writes (`iwrite`) copy the data into an internal buffer, and
+/// start the write without waiting for it to finish. The iterations can
+/// continue while the data is written. They are completed by `wait`, which
+/// is also called by `close`. With a progress thread (see MPIProgress), the
+/// writes make progress even when the rank does not call into MPI.
+///
+/// Hints such as `striping_factor`, `striping_unit` and `cb_nodes` can be
+/// passed to the file system at opening. For example,
+/// ~~~{.cpp}
+/// MPI_Info info;
+/// MPI_Info_create(&info);
+/// MPI_Info_set(info, "striping_factor", "16");
+/// vsmc::MPIFile file(world, "snapshot.bin",
+///     MPI_MODE_CREATE | MPI_MODE_WRONLY, info);
+/// MPI_Info_free(&info);
+/// file.alignment(1 << 20);
+/// file.iwrite(N, data);
+/// // ...
+/// file.close();
+/// ~~~
+class MPIFile
+{
+    public:
+    MPIFile() : file_(MPI_FILE_NULL), alignment_(1), offset_(0) {}
+
+    /// \brief Open a file collectively
+    MPIFile(const ::boost::mpi::communicator &world,
+        const std::string &filename,
+        int amode = MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        ::MPI_Info info = MPI_INFO_NULL)
+        : file_(MPI_FILE_NULL), alignment_(1), offset_(0)
+    {
+        open(world, filename, amode, info);
+    }
+
+    MPIFile(const MPIFile &) = delete;
+    MPIFile &operator=(const MPIFile &) = delete;
+
+    ~MPIFile() { close(); }
+
+    /// \brief Open a file collectively, close the current one if any
+    ///
+    /// \details
+    /// If `amode` contains `MPI_MODE_WRONLY` but not `MPI_MODE_APPEND`, an
+    /// existing file is truncated, such that a shorter snapshot does not
+    /// leave the tail of an older one. Files opened with `MPI_MODE_RDWR` are
+    /// not truncated.
+    ///
+    /// \return If the file is opened successfully
+    bool open(const ::boost::mpi::communicator &world,
+        const std::string &filename,
+        int amode = MPI_MODE_CREATE | MPI_MODE_WRONLY,
+        ::MPI_Info info = MPI_INFO_NULL)
+    {
+        close();
+        world_ =
+            ::boost::mpi::communicator(world, ::boost::mpi::comm_duplicate);
+        offset_ = 0;
+        int status = ::MPI_File_open(static_cast<MPI_Comm>(world_),
+            const_cast<char *>(filename.c_str()), amode, info, &file_);
+        if (status != MPI_SUCCESS) {
+            VSMC_RUNTIME_WARNING_MPI_MPI_IO_OPEN;
+            file_ = MPI_FILE_NULL;
+            return false;
+        }
+        const bool truncate =
+            (amode & MPI_MODE_WRONLY) != 0 && (amode & MPI_MODE_APPEND) == 0;
+        if (truncate) {
+            status = ::MPI_File_set_size(file_, 0);
+            internal::mpi_error_check(
+                status, "MPIFile::open", "::MPI_File_set_size");
+        }
+
+        return true;
+    }
+
+    /// \brief Complete all pending writes and close the file collectively
+    void close()
+    {
+        if (file_ == MPI_FILE_NULL)
+            return;
+
+        wait();
+        ::MPI_File_close(&file_);
+        file_ = MPI_FILE_NULL;
+    }
+
+    bool is_open() const { return file_ != MPI_FILE_NULL; }
+
+    /// \brief The underlying MPI file handle
+    ::MPI_File get() const { return file_; }
+
+    /// \brief A duplicated MPI communicator for this file
+    const ::boost::mpi::communicator &world() const { return world_; }
+
+    /// \brief The alignment of blocks in bytes
+    std::size_t alignment() const { return alignment_; }
+
+    /// \brief Set the alignment of blocks in bytes, it shall be the same on
+    /// all ranks
+    void alignment(std::size_t align) { alignment_ = align == 0 ? 1 : align; }
+
+    /// \brief The end of the data written so far in bytes, the same on all
+    /// ranks
+    ::MPI_Offset offset() const { return offset_; }
+
+    /// \brief Set the position where the next block starts, it shall be the
+    /// same on all ranks
+    void offset(::MPI_Offset off) { offset_ = off; }
+
+    /// \brief Write `n` elements from each rank collectively
+    ///
+    /// \return The offset in bytes where the block of this rank starts
+    template <typename T>
+    ::MPI_Offset write(std::size_t n, const T *first)
+    {
+        const std::size_t bytes = n * sizeof(T);
+        const ::MPI_Offset off = block(bytes);
+        write_at(off, n, first);
+
+        return off;
+    }
+
+    /// \brief Write `n` elements from each rank without waiting for the
+    /// write to finish
+    ///
+    /// \details
+    /// The offsets are computed collectively, and the data is copied before
+    /// the function returns, thus the input can be modified afterwards.
+    ///
+    /// \return The offset in bytes where the block of this rank starts
+    template <typename T>
+    ::MPI_Offset iwrite(std::size_t n, const T *first)
+    {
+        const ::MPI_Offset off = block(n * sizeof(T));
+        iwrite_at(off, n, first);
+
+        return off;
+    }
+
+    /// \brief Write `n` elements from each rank collectively, preceded by an
+    /// index of the blocks of all ranks
+    ///
+    /// \details
+    /// The index is written by rank zero at the aligned end of the data
+    /// written so far. It is an array of `std::uint64_t`, the number of ranks
+    /// `P` followed by the offset and the size in bytes of the block of each
+    /// rank. The blocks follow the index as with `write` and `iwrite`. The
+    /// data can thus be read back on any number of ranks, see `read_index`,
+    /// even if the alignment leaves holes between blocks.
+    ///
+    /// \return The offset in bytes where the block of this rank starts
+    template <typename T>
+    ::MPI_Offset write_indexed(std::size_t n, const T *first, bool async)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN;
+
+        const std::size_t P = static_cast<std::size_t>(world_.size());
+        const ::MPI_Offset off_index = align(offset_);
+        offset_ = off_index +
+            static_cast<::MPI_Offset>(sizeof(std::uint64_t) * (1 + 2 * P));
+        const ::MPI_Offset off = block(n * sizeof(T));
+        if (world_.rank() == 0) {
+            std::vector<std::uint64_t> index(1 + 2 * P);
+            index[0] = static_cast<std::uint64_t>(P);
+            for (std::size_t r = 0; r != P; ++r) {
+                index[1 + 2 * r] = static_cast<std::uint64_t>(offset_all_[r]);
+                index[2 + 2 * r] = static_cast<std::uint64_t>(bytes_all_[r]);
+            }
+            write_bytes(off_index, index.size() * sizeof(std::uint64_t),
+                index.data(), "MPIFile::write_indexed");
+        }
+        if (async)
+            iwrite_at(off, n, first);
+        else
+            write_at(off, n, first);
+
+        return off;
+    }
+
+    /// \brief Read the index written by `write_indexed` collectively
+    ///
+    /// \param off The offset where the index starts, the aligned end of the
+    /// data before the call of `write_indexed`
+    ///
+    /// \return The offset and the size in bytes of the block of each rank of
+    /// the writer, in the order of its ranks
+    std::vector<std::pair<::MPI_Offset, std::size_t>> read_index(
+        ::MPI_Offset off) const
+    {
+        std::uint64_t P = 0;
+        read_at(off, 1, &P);
+        std::vector<std::uint64_t> index(static_cast<std::size_t>(P * 2));
+        read_at(off + static_cast<::MPI_Offset>(sizeof(std::uint64_t)),
+            index.size(), index.data());
+        std::vector<std::pair<::MPI_Offset, std::size_t>> blocks;
+        for (std::size_t r = 0; r != P; ++r) {
+            blocks.push_back(
+                std::make_pair(static_cast<::MPI_Offset>(index[2 * r]),
+                    static_cast<std::size_t>(index[2 * r + 1])));
+        }
+
+        return blocks;
+    }
+
+    /// \brief Write `n` elements from the rank `root` only
+    ///
+    /// \details
+    /// This is still collective. The arguments on other ranks are ignored.
+    ///
+    /// \return The offset in bytes where the block starts
+    template <typename T>
+    ::MPI_Offset write_root(std::size_t n, const T *first, int root = 0)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN;
+
+        std::size_t bytes = n * sizeof(T);
+        ::boost::mpi::broadcast(world_, bytes, root);
+        const ::MPI_Offset off = align(offset_);
+        offset_ = off + static_cast<::MPI_Offset>(bytes);
+        if (world_.rank() == root)
+            write_bytes(off, bytes, first, "MPIFile::write_root");
+
+        return off;
+    }
+
+    /// \brief Write `n` elements at a given offset collectively
+    ///
+    /// \details
+    /// The offset is not advanced, all ranks shall call this function
+    template <typename T>
+    void write_at(::MPI_Offset off, std::size_t n, const T *first)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN;
+
+        const std::size_t bytes = n * sizeof(T);
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_COUNT(bytes);
+        ::MPI_Status mpi_status;
+        int status = ::MPI_File_write_at_all(file_, off,
+            const_cast<T *>(first), static_cast<int>(bytes), MPI_BYTE,
+            &mpi_status);
+        internal::mpi_error_check(
+            status, "MPIFile::write_at", "::MPI_File_write_at_all");
+    }
+
+    /// \brief Write `n` elements at a given offset collectively without
+    /// waiting for the write to finish
+    ///
+    /// \details
+    /// The offset is not advanced, all ranks shall call this function. The
+    /// data is copied before the function returns.
+    template <typename T>
+    void iwrite_at(::MPI_Offset off, std::size_t n, const T *first)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN;
+
+        const std::size_t bytes = n * sizeof(T);
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_COUNT(bytes);
+        buffer_.push_back(Vector<char>(bytes));
+        if (bytes != 0)
+            std::memcpy(buffer_.back().data(), first, bytes);
+
+        ::MPI_Request request;
+#if VSMC_MPI_HAS_IWRITE_AT_ALL
+        int status = ::MPI_File_iwrite_at_all(file_, off,
+            buffer_.back().data(), static_cast<int>(bytes), MPI_BYTE,
+            &request);
+        internal::mpi_error_check(
+            status, "MPIFile::iwrite_at", "::MPI_File_iwrite_at_all");
+#else
+        int status = ::MPI_File_iwrite_at(file_, off, buffer_.back().data(),
+            static_cast<int>(bytes), MPI_BYTE, &request);
+        internal::mpi_error_check(
+            status, "MPIFile::iwrite_at", "::MPI_File_iwrite_at");
+#endif
+        request_.push_back(request);
+    }
+
+    /// \brief Read `n` elements at a given offset collectively
+    template <typename T>
+    void read_at(::MPI_Offset off, std::size_t n, T *first) const
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_OPEN;
+
+        const std::size_t bytes = n * sizeof(T);
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_COUNT(bytes);
+        ::MPI_Status mpi_status;
+        int status = ::MPI_File_read_at_all(file_, off, first,
+            static_cast<int>(bytes), MPI_BYTE, &mpi_status);
+        internal::mpi_error_check(
+            status, "MPIFile::read_at", "::MPI_File_read_at_all");
+    }
+
+    /// \brief Test if all pending nonblocking writes are finished
+    bool test()
+    {
+        if (request_.size() == 0)
+            return true;
+
+        int flag = 0;
+        ::MPI_Testall(static_cast<int>(request_.size()), request_.data(),
+            &flag, MPI_STATUSES_IGNORE);
+        if (flag != 0)
+            clear();
+
+        return flag != 0;
+    }
+
+    /// \brief Wait for all pending nonblocking writes to finish
+    void wait()
+    {
+        if (request_.size() == 0)
+            return;
+
+        ::MPI_Waitall(static_cast<int>(request_.size()), request_.data(),
+            MPI_STATUSES_IGNORE);
+        clear();
+    }
+
+    /// \brief Round up an offset to a multiple of `alignment()`
+    ::MPI_Offset align(::MPI_Offset off) const
+    {
+        const ::MPI_Offset a = static_cast<::MPI_Offset>(alignment_);
+
+        return (off + a - 1) / a * a;
+    }
+
+    private:
+    ::boost::mpi::communicator world_;
+    ::MPI_File file_;
+    std::size_t alignment_;
+    ::MPI_Offset offset_;
+    std::vector<::MPI_Request> request_;
+    std::list<Vector<char>> buffer_;
+    std::vector<std::size_t> bytes_all_;
+    std::vector<::MPI_Offset> offset_all_;
+
+    ::MPI_Offset block(std::size_t bytes)
+    {
+        ::boost::mpi::all_gather(world_, bytes, bytes_all_);
+        offset_all_.resize(bytes_all_.size());
+        ::MPI_Offset pos = offset_;
+        for (std::size_t r = 0; r != bytes_all_.size(); ++r) {
+            pos = align(pos);
+            offset_all_[r] = pos;
+            pos += static_cast<::MPI_Offset>(bytes_all_[r]);
+        }
+        offset_ = pos;
+
+        return offset_all_[static_cast<std::size_t>(world_.rank())];
+    }
+
+    template <typename T>
+    void write_bytes(
+        ::MPI_Offset off, std::size_t bytes, const T *first, const char *func)
+    {
+        VSMC_RUNTIME_ASSERT_MPI_MPI_IO_COUNT(bytes);
+        ::MPI_Status mpi_status;
+        int status = ::MPI_File_write_at(file_, off, const_cast<T *>(first),
+            static_cast<int>(bytes), MPI_BYTE, &mpi_status);
+        internal::mpi_error_check(status, func, "::MPI_File_write_at");
+    }
+
+    void clear()
+    {
+        request_.clear();
+        buffer_.clear();
+    }
+}; // class MPIFile
+
+/// \brief Write the normalized weights of all particles collectively
+/// \ingroup MPI
+///
+/// \details
+/// The weights are written in the order of the global particle ids, as one
+/// vector of `double` of length of the total number of particles
+/// (contiguous if the alignment of the file is one). They are preceded by
+/// an index of the blocks of all ranks, see MPIFile::write_indexed.
+///
+/// \return The offset in bytes where the weights of this rank start
+template <typename T>
+inline ::MPI_Offset mpi_write_weight(
+    MPIFile &file, const Particle<T> &particle, bool async = true)
+{
+    Vector<double> weight(static_cast<std::size_t>(particle.size()));
+    particle.weight().read_weight(weight.data());
+
+    return file.write_indexed(weight.size(), weight.data(), async);
+}
+
+/// \brief Write the states of all particles collectively
+/// \ingroup MPI
+///
+/// \details
+/// The value type shall be a StateMPI, whose `state_pack_local` is used to
+/// obtain the states. The states are written in the order of the global
+/// particle ids, preceded by an index of the blocks of all ranks, see
+/// MPIFile::write_indexed.
+///
+/// \return The offset in bytes where the states of this rank start
+template <typename T>
+inline ::MPI_Offset mpi_write_state(
+    MPIFile &file, Particle<T> &particle, bool async = true)
+{
+    Vector<char> state;
+    particle.value().state_pack_local(state);
+
+    return file.write_indexed(state.size(), state.data(), async);
+}
+
+} // namespace vsmc
+
+#endif // VSMC_MPI_MPI_IO_HPP
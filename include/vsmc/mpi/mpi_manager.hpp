@@ -34,6 +34,26 @@
 
 #include <vsmc/mpi/internal/common.hpp>
 #include <vsmc/rng/seed.hpp>
+#include <boost/serialization/string.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_MANAGER_PROGRESS_THREAD_LEVEL           \
+    VSMC_RUNTIME_WARNING((env_.thread_level() ==                              \
+                             ::boost::mpi::threading::multiple),              \
+        "**MPIEnvironment::progress_start** MPI IS NOT INITIALIZED WITH "     \
+        "MPI_THREAD_MULTIPLE")
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_MANAGER_PROGRESS_AFFINITY               \
+    VSMC_RUNTIME_WARNING(                                                     \
+        false, "**MPIProgress::start** FAILED TO SET THREAD AFFINITY")
 
 namespace vsmc
 {
@@ -54,14 +74,190 @@ inline void mpi_init_seed(std::array<T, K> &s, IntType1, IntType2 R)
     s.back() = static_cast<Seed::skip_type>(R);
 }
 
+template <typename ResultType>
+inline void mpi_global_seed(ResultType &)
+{
+    Seed::instance().modulo(1, 0);
+}
+
+template <typename T, std::size_t K>
+inline void mpi_global_seed(std::array<T, K> &)
+{
+}
+
+/// \brief Split a communicator into ones of processes sharing a node
+inline ::boost::mpi::communicator mpi_node_comm(
+    const ::boost::mpi::communicator &world)
+{
+#if MPI_VERSION >= 3
+    MPI_Comm node;
+    ::MPI_Comm_split_type(static_cast<MPI_Comm>(world), MPI_COMM_TYPE_SHARED,
+        world.rank(), MPI_INFO_NULL, &node);
+
+    return ::boost::mpi::communicator(
+        node, ::boost::mpi::comm_take_ownership);
+#else
+    char name[MPI_MAX_PROCESSOR_NAME];
+    int len = 0;
+    ::MPI_Get_processor_name(name, &len);
+    std::vector<std::string> name_all;
+    ::boost::mpi::all_gather(world, std::string(name, name + len), name_all);
+    const std::string &this_name =
+        name_all[static_cast<std::size_t>(world.rank())];
+    const int color = static_cast<int>(
+        std::find(name_all.begin(), name_all.end(), this_name) -
+        name_all.begin());
+
+    return world.split(color, world.rank());
+#endif
+}
+
 } // namespace vsmc::internal
 
+/// \brief How Seed is initialized on each rank
+/// \ingroup MPI
+enum MPISeedScheme {
+    MPISeedRank,  ///< Seed depends on the rank and the size of the world
+    MPISeedGlobal ///< Seed is the same on all ranks
+};                // enum MPISeedScheme
+
+/// \brief MPI progress thread
+/// \ingroup MPI
+///
+/// \details
+/// A dedicated thread that keeps polling the MPI library, such that
+/// outstanding nonblocking operations make progress while the other threads
+/// are busy with computations. MPI shall be initialized with
+/// `MPI_THREAD_MULTIPLE` before the thread is started.
+class MPIProgress
+{
+    public:
+    MPIProgress() : running_(false), comm_(MPI_COMM_NULL) {}
+
+    MPIProgress(const MPIProgress &) = delete;
+    MPIProgress &operator=(const MPIProgress &) = delete;
+
+    ~MPIProgress() { stop(); }
+
+    /// \brief If the progress thread is running
+    bool running() const { return running_; }
+
+    /// \brief Start the progress thread
+    ///
+    /// \param core The logical core the thread is pinned to. If it is
+    /// negative, the affinity is left to the operating system
+    /// \param interval The time the thread sleeps between two polls. If it
+    /// is zero, the thread backs off instead, sleeping one microsecond after
+    /// the first poll, and twice as long after each of the following ones,
+    /// up to `max_backoff()`, such that it does not spin a core
+    void start(int core = -1,
+        std::chrono::microseconds interval = std::chrono::microseconds(0))
+    {
+        if (running_)
+            return;
+
+        int status = ::MPI_Comm_dup(MPI_COMM_SELF, &comm_);
+        internal::mpi_error_check(
+            status, "MPIProgress::start", "::MPI_Comm_dup");
+        if (status != MPI_SUCCESS) {
+            comm_ = MPI_COMM_NULL;
+            return;
+        }
+        running_ = true;
+        thread_ = std::thread([this, interval]() { poll(interval); });
+        set_affinity(core);
+    }
+
+    /// \brief Stop the progress thread and wait for it to finish
+    void stop()
+    {
+        if (!running_)
+            return;
+
+        running_ = false;
+        thread_.join();
+        int status = ::MPI_Comm_free(&comm_);
+        internal::mpi_error_check(
+            status, "MPIProgress::stop", "::MPI_Comm_free");
+    }
+
+    /// \brief The longest sleep between two polls when backing off
+    static constexpr std::chrono::microseconds max_backoff()
+    {
+        return std::chrono::microseconds(256);
+    }
+
+    private:
+    std::atomic<bool> running_;
+    std::thread thread_;
+    MPI_Comm comm_;
+
+    void poll(std::chrono::microseconds interval) const
+    {
+        int flag = 0;
+        std::chrono::microseconds backoff(1);
+        while (running_) {
+            ::MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, comm_, &flag,
+                MPI_STATUS_IGNORE);
+            if (interval.count() != 0) {
+                std::this_thread::sleep_for(interval);
+                continue;
+            }
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, max_backoff());
+        }
+    }
+
+#if defined(__linux__)
+    void set_affinity(int core)
+    {
+        if (core < 0)
+            return;
+
+        ::cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(core, &cpuset);
+        int status = ::pthread_setaffinity_np(
+            thread_.native_handle(), sizeof(::cpu_set_t), &cpuset);
+        if (status != 0)
+            VSMC_RUNTIME_WARNING_MPI_MPI_MANAGER_PROGRESS_AFFINITY;
+    }
+#else  // defined(__linux__)
+    void set_affinity(int core)
+    {
+        if (core >= 0)
+            VSMC_RUNTIME_WARNING_MPI_MPI_MANAGER_PROGRESS_AFFINITY;
+    }
+#endif // defined(__linux__)
+}; // class MPIProgress
+
 /// \brief MPI Environment
 /// \ingroup MPI
 ///
 /// \details
 /// Use this class in place of `boost::mpi::environment` to correctly
 /// initialize Seed
+///
+/// Optionally, a threading level can be requested and a progress thread
+/// (see MPIProgress) can be started. For example,
+/// ~~~{.cpp}
+/// vsmc::MPIEnvironment env(argc, argv, boost::mpi::threading::multiple);
+/// env.progress_start(7); // Drive MPI communications on the 8th core
+/// ~~~
+/// The progress thread is stopped before MPI is finalized.
+///
+/// The processes sharing a node (e.g., a shared memory domain) are grouped
+/// by `node()`, and `node_rank()` and `node_size()` can be used to bind each
+/// process to a distinct device, see CLManager::setup.
+///
+/// By default (MPISeedRank), the seed on each rank depends on the rank and
+/// the size of the world, and thus the random streams change with the
+/// number of ranks. With MPISeedGlobal, all ranks share the seed of rank
+/// zero. Random streams shall then be keyed by the global particle id to be
+/// distinct, and the results no longer depend on the number of ranks. For
+/// instance, StateMPI<StateCL> injects `SEED` offset by the global id of the
+/// first local particle, such that `SEED + i` is the same for a particle
+/// regardless how particles are distributed among ranks.
 class MPIEnvironment
 {
     public:
@@ -70,6 +266,15 @@ class MPIEnvironment
         : env_(abort_on_exception)
     {
         init_seed();
+        init_node();
+    }
+
+    explicit MPIEnvironment(::boost::mpi::threading::level thread_level,
+        bool abort_on_exception = true)
+        : env_(thread_level, abort_on_exception)
+    {
+        init_seed();
+        init_node();
     }
 #endif
 
@@ -77,19 +282,101 @@ class MPIEnvironment
         : env_(argc, argv, abort_on_exception)
     {
         init_seed();
+        init_node();
+    }
+
+    MPIEnvironment(int &argc, char **&argv,
+        ::boost::mpi::threading::level thread_level,
+        bool abort_on_exception = true)
+        : env_(argc, argv, thread_level, abort_on_exception)
+    {
+        init_seed();
+        init_node();
+    }
+
+    /// \brief The threading level provided by the MPI implementation
+    ::boost::mpi::threading::level thread_level() const
+    {
+        return env_.thread_level();
+    }
+
+    /// \brief A communicator of processes on the same node
+    const ::boost::mpi::communicator &node() const { return node_; }
+
+    /// \brief The rank of this process among those on the same node
+    int node_rank() const { return node_.rank(); }
+
+    /// \brief The number of processes on the same node
+    int node_size() const { return node_.size(); }
+
+    /// \brief The progress thread
+    MPIProgress &progress() { return progress_; }
+
+    /// \brief Start the progress thread
+    ///
+    /// \details
+    /// The thread is not started if the provided threading level is not
+    /// `MPI_THREAD_MULTIPLE`. See MPIProgress::start for the parameters.
+    bool progress_start(int core = -1,
+        std::chrono::microseconds interval = std::chrono::microseconds(0))
+    {
+        VSMC_RUNTIME_WARNING_MPI_MPI_MANAGER_PROGRESS_THREAD_LEVEL;
+        if (env_.thread_level() != ::boost::mpi::threading::multiple)
+            return false;
+
+        progress_.start(core, interval);
+
+        return true;
+    }
+
+    /// \brief Stop the progress thread
+    void progress_stop() { progress_.stop(); }
+
+    /// \brief The current seed scheme
+    MPISeedScheme seed_scheme() const { return seed_scheme_; }
+
+    /// \brief Change the seed scheme
+    ///
+    /// \details
+    /// This shall be called on all ranks before any random numbers are
+    /// generated. The seed is reset to the one of rank zero at construction.
+    void seed_scheme(MPISeedScheme scheme)
+    {
+        ::boost::mpi::communicator world;
+        Seed::result_type s(seed_);
+        ::boost::mpi::broadcast(world, s, 0);
+        if (scheme == MPISeedRank)
+            internal::mpi_init_seed(s, world.size(), world.rank());
+        else
+            internal::mpi_global_seed(s);
+        Seed::instance().set(s);
+        seed_scheme_ = scheme;
+        world.barrier();
     }
 
     private:
     ::boost::mpi::environment env_;
+    ::boost::mpi::communicator node_;
+    MPIProgress progress_;
+    MPISeedScheme seed_scheme_;
+    Seed::result_type seed_;
 
-    void init_seed() const
+    void init_seed()
     {
         ::boost::mpi::communicator world;
-        Seed::result_type s(Seed::instance().get());
+        seed_scheme_ = MPISeedRank;
+        seed_ = Seed::instance().get();
+        Seed::result_type s(seed_);
         internal::mpi_init_seed(s, world.size(), world.rank());
         Seed::instance().set(s);
         world.barrier();
     }
+
+    void init_node()
+    {
+        ::boost::mpi::communicator world;
+        node_ = internal::mpi_node_comm(world);
+    }
 }; // class MPIEnvironment
 
 /// \brief MPI Communicator
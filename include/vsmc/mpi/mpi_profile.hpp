@@ -0,0 +1,275 @@
+//============================================================================
+// vSMC/include/vsmc/mpi/mpi_profile.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_MPI_MPI_PROFILE_HPP
+#define VSMC_MPI_MPI_PROFILE_HPP
+
+#include <vsmc/mpi/internal/common.hpp>
+#include <iomanip>
+
+namespace vsmc
+{
+
+/// \brief Communication phases profiled by MPIProfile
+/// \ingroup MPI
+enum MPIProfilePhase {
+    MPIProfileCopyBroadcast,  ///< Broadcast of `src_idx` in StateMPI::copy
+    MPIProfileCopyPlacement,  ///< Gather of placement keys in StateMPI::copy
+    MPIProfileCopyThisNode,   ///< Local copy in StateMPI::copy_this_node
+    MPIProfileCopyInterNode,  ///< Send/recv in StateMPI::copy_inter_node
+    MPIProfileResampleGather, ///< Gather of weights in WeightMPI
+    MPIProfileWeightReduce,   ///< ESS and normalization reductions
+    MPIProfilePhaseNum        ///< The number of phases
+};                            // enum MPIProfilePhase
+
+/// \brief Counters of a communication phase
+/// \ingroup MPI
+struct MPIProfileCounter {
+    MPIProfileCounter()
+        : calls(0), bytes(0), messages(0), time(0), wait(0)
+    {
+    }
+
+    std::size_t calls;    ///< The number of calls of the phase
+    std::size_t bytes;    ///< The number of bytes sent and received
+    std::size_t messages; ///< The number of messages (or collectives)
+    double time;          ///< The wall time in seconds
+    double wait;          ///< The time blocked in MPI calls in seconds
+};                        // struct MPIProfileCounter
+
+/// \brief MPI communication profiler
+/// \ingroup MPI
+///
+/// \details
+/// When the macro `VSMC_MPI_PROFILE` is defined to a non-zero value before
+/// any vSMC header is included, WeightMPI and StateMPI with the same `ID`
+/// accumulate counters of each communication phase (see MPIProfilePhase).
+/// Otherwise the instrumentation compiles to nothing, and all counters stay
+/// zero.
+///
+/// The cumulative counters are updated as the phases happen. Each call of
+/// `record` appends the counters since the last call to the history, which
+/// is usually done once per iteration. MPIProfileEval does so as a Monitor,
+/// such that the history is also queryable from the Sampler.
+template <typename ID = MPIDefault>
+class MPIProfile
+{
+    public:
+    using counter_type = std::array<MPIProfileCounter, MPIProfilePhaseNum>;
+
+    MPIProfile(const MPIProfile<ID> &) = delete;
+    MPIProfile<ID> &operator=(const MPIProfile<ID> &) = delete;
+
+    static MPIProfile<ID> &instance()
+    {
+        static MPIProfile<ID> profile;
+
+        return profile;
+    }
+
+    /// \brief If profiling is compiled in
+    static constexpr bool enabled() { return VSMC_MPI_PROFILE != 0; }
+
+    /// \brief The cumulative counters of a phase
+    const MPIProfileCounter &counter(MPIProfilePhase phase) const
+    {
+        return total_[phase];
+    }
+
+    /// \brief The counters of a phase at a recorded iteration
+    const MPIProfileCounter &counter(
+        std::size_t iter, MPIProfilePhase phase) const
+    {
+        return history_[iter][phase];
+    }
+
+    /// \brief The number of recorded iterations
+    std::size_t iter_size() const { return history_.size(); }
+
+    /// \brief Accumulate counters of a phase
+    void add(MPIProfilePhase phase, std::size_t bytes, std::size_t messages,
+        double time, double wait)
+    {
+        MPIProfileCounter &c = total_[phase];
+        ++c.calls;
+        c.bytes += bytes;
+        c.messages += messages;
+        c.time += time;
+        c.wait += wait;
+    }
+
+    /// \brief Append the counters since the last call to the history
+    void record()
+    {
+        counter_type iter;
+        for (std::size_t i = 0; i != MPIProfilePhaseNum; ++i) {
+            iter[i].calls = total_[i].calls - last_[i].calls;
+            iter[i].bytes = total_[i].bytes - last_[i].bytes;
+            iter[i].messages = total_[i].messages - last_[i].messages;
+            iter[i].time = total_[i].time - last_[i].time;
+            iter[i].wait = total_[i].wait - last_[i].wait;
+        }
+        history_.push_back(iter);
+        last_ = total_;
+    }
+
+    /// \brief Reset all counters and clear the history
+    void clear()
+    {
+        total_ = counter_type();
+        last_ = counter_type();
+        history_.clear();
+    }
+
+    /// \brief Print the cumulative counters
+    template <typename CharT, typename Traits>
+    std::basic_ostream<CharT, Traits> &print(
+        std::basic_ostream<CharT, Traits> &os) const
+    {
+        static const char *name[] = {"CopyBroadcast", "CopyPlacement",
+            "CopyThisNode", "CopyInterNode", "ResampleGather",
+            "WeightReduce"};
+
+        os << std::left;
+        os << std::setw(16) << "Phase" << std::setw(12) << "Calls";
+        os << std::setw(16) << "Bytes" << std::setw(12) << "Messages";
+        os << std::setw(12) << "Time" << std::setw(12) << "Wait";
+        os << std::endl;
+        for (std::size_t i = 0; i != MPIProfilePhaseNum; ++i) {
+            os << std::setw(16) << name[i];
+            os << std::setw(12) << total_[i].calls;
+            os << std::setw(16) << total_[i].bytes;
+            os << std::setw(12) << total_[i].messages;
+            os << std::setw(12) << total_[i].time;
+            os << std::setw(12) << total_[i].wait;
+            os << std::endl;
+        }
+
+        return os;
+    }
+
+    private:
+    counter_type total_;
+    counter_type last_;
+    std::vector<counter_type> history_;
+
+    MPIProfile() {}
+}; // class MPIProfile
+
+/// \brief Monitor<T>::eval_type subtype recording MPIProfile
+/// \ingroup MPI
+///
+/// \details
+/// Used as the evaluation function of a record only Monitor, each iteration
+/// it calls MPIProfile::record and stores the counters of the iteration,
+/// five values (calls, bytes, messages, time, wait) for each phase in the
+/// order of MPIProfilePhase. For example,
+/// ~~~{.cpp}
+/// sampler.monitor("mpi", vsmc::MPIProfileEval<T>::dim(),
+///     vsmc::MPIProfileEval<T>(), true);
+/// ~~~
+template <typename T, typename ID = MPIDefault>
+class MPIProfileEval
+{
+    public:
+    /// \brief The dimension of the Monitor
+    static constexpr std::size_t dim() { return MPIProfilePhaseNum * 5; }
+
+    void operator()(std::size_t, std::size_t, Particle<T> &, double *r)
+    {
+        MPIProfile<ID> &profile = MPIProfile<ID>::instance();
+        profile.record();
+        const std::size_t iter = profile.iter_size() - 1;
+        for (std::size_t i = 0; i != MPIProfilePhaseNum; ++i) {
+            const MPIProfileCounter &c =
+                profile.counter(iter, static_cast<MPIProfilePhase>(i));
+            *r++ = static_cast<double>(c.calls);
+            *r++ = static_cast<double>(c.bytes);
+            *r++ = static_cast<double>(c.messages);
+            *r++ = c.time;
+            *r++ = c.wait;
+        }
+    }
+}; // class MPIProfileEval
+
+namespace internal
+{
+
+#if VSMC_MPI_PROFILE
+
+template <typename ID>
+class MPIProfileTimer
+{
+    public:
+    explicit MPIProfileTimer(MPIProfilePhase phase)
+        : phase_(phase), start_(::MPI_Wtime()), wait_(0), wait_start_(0)
+    {
+    }
+
+    void wait_start() { wait_start_ = ::MPI_Wtime(); }
+
+    void wait_stop() { wait_ += ::MPI_Wtime() - wait_start_; }
+
+    void stop(std::size_t bytes, std::size_t messages)
+    {
+        MPIProfile<ID>::instance().add(
+            phase_, bytes, messages, ::MPI_Wtime() - start_, wait_);
+    }
+
+    private:
+    MPIProfilePhase phase_;
+    double start_;
+    double wait_;
+    double wait_start_;
+}; // class MPIProfileTimer
+
+#else // VSMC_MPI_PROFILE
+
+template <typename ID>
+class MPIProfileTimer
+{
+    public:
+    explicit MPIProfileTimer(MPIProfilePhase) {}
+
+    void wait_start() {}
+
+    void wait_stop() {}
+
+    void stop(std::size_t, std::size_t) {}
+}; // class MPIProfileTimer
+
+#endif // VSMC_MPI_PROFILE
+
+} // namespace vsmc::internal
+
+} // namespace vsmc
+
+#endif // VSMC_MPI_MPI_PROFILE_HPP
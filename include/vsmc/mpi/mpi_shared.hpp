@@ -0,0 +1,259 @@
+//============================================================================
+// vSMC/include/vsmc/mpi/mpi_shared.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_MPI_MPI_SHARED_HPP
+#define VSMC_MPI_MPI_SHARED_HPP
+
+#include <vsmc/mpi/internal/common.hpp>
+#include <vsmc/mpi/mpi_manager.hpp>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VSMC_MPI_HAS_MMAP 1
+#else
+#define VSMC_MPI_HAS_MMAP 0
+#endif
+
+#if MPI_VERSION >= 3
+#define VSMC_MPI_HAS_SHARED_WINDOW 1
+#else
+#define VSMC_MPI_HAS_SHARED_WINDOW 0
+#endif
+
+#define VSMC_RUNTIME_WARNING_MPI_MPI_SHARED_READ                              \
+    VSMC_RUNTIME_WARNING(false, "**MPISharedData::read** FAILED TO READ FILE")
+
+namespace vsmc
+{
+
+/// \brief Read-only data shared by all processes on a node
+/// \ingroup MPI
+///
+/// \details
+/// The data is read once by the rank zero of the communicator, broadcast
+/// once to one process on each of the other nodes, and stored in an MPI
+/// shared memory window, which all processes on the same node access
+/// directly. Thus the file system sees a single read, and each node holds a
+/// single copy of the data. Without MPI-3 shared memory windows, each
+/// process holds its own copy instead.
+///
+/// All member functions other than accessors are collective over the
+/// communicator, including the destructor.
+///
+/// For example, to upload observations to an OpenCL device,
+/// ~~~{.cpp}
+/// vsmc::MPISharedData<cl_float> obs;
+/// obs.read(world, "obs.bin"); // Raw binary array of cl_float
+/// manager.write_buffer(buffer, obs.size(), obs.data());
+/// ~~~
+template <typename T>
+class MPISharedData
+{
+    public:
+    using value_type = T;
+    using size_type = std::size_t;
+
+    MPISharedData() : win_(MPI_WIN_NULL), data_(nullptr), size_(0) {}
+
+    MPISharedData(const MPISharedData<T> &) = delete;
+    MPISharedData<T> &operator=(const MPISharedData<T> &) = delete;
+
+    ~MPISharedData() { release(); }
+
+    /// \brief Read a raw binary array of `T` from a file
+    ///
+    /// \details
+    /// The file is only opened by rank zero, memory mapped if it is
+    /// supported. The number of elements is the size of the file divided by
+    /// `sizeof(T)`.
+    ///
+    /// \return If the file is read successfully
+    bool read(
+        const ::boost::mpi::communicator &world, const std::string &filename)
+    {
+        const T *first = nullptr;
+        size_type n = 0;
+        bool success = true;
+#if VSMC_MPI_HAS_MMAP
+        void *map = MAP_FAILED;
+        std::size_t bytes = 0;
+        if (world.rank() == 0) {
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            struct ::stat st;
+            success = fd != -1 && ::fstat(fd, &st) == 0;
+            if (success) {
+                bytes = static_cast<std::size_t>(st.st_size);
+                if (bytes != 0) {
+                    map = ::mmap(
+                        nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+                    success = map != MAP_FAILED;
+                }
+            }
+            if (fd != -1)
+                ::close(fd);
+            if (success && bytes != 0) {
+                first = static_cast<const T *>(map);
+                n = bytes / sizeof(T);
+            }
+        }
+#else
+        Vector<T> buffer;
+        if (world.rank() == 0) {
+            std::ifstream file(filename.c_str(), std::ios_base::binary);
+            file.seekg(0, std::ios_base::end);
+            std::streamoff bytes = file.tellg();
+            file.seekg(0, std::ios_base::beg);
+            success = file.good() && bytes >= 0;
+            if (success) {
+                n = static_cast<size_type>(bytes) / sizeof(T);
+                buffer.resize(n);
+                file.read(reinterpret_cast<char *>(buffer.data()),
+                    static_cast<std::streamsize>(n * sizeof(T)));
+                success = file.good();
+                first = buffer.data();
+            }
+        }
+#endif
+        ::boost::mpi::broadcast(world, success, 0);
+        if (success)
+            assign(world, n, first);
+        else
+            VSMC_RUNTIME_WARNING_MPI_MPI_SHARED_READ;
+#if VSMC_MPI_HAS_MMAP
+        if (map != MAP_FAILED)
+            ::munmap(map, bytes);
+#endif
+
+        return success;
+    }
+
+    /// \brief Share `n` elements from `first` on rank zero
+    ///
+    /// \details
+    /// The arguments on other ranks are ignored. This is useful when the
+    /// data needs to be parsed, for example, from a text file.
+    void assign(const ::boost::mpi::communicator &world, size_type n,
+        const T *first)
+    {
+        release();
+        ::boost::mpi::broadcast(world, n, 0);
+        size_ = n;
+        const std::size_t bytes = n * sizeof(T);
+
+#if VSMC_MPI_HAS_SHARED_WINDOW
+        ::boost::mpi::communicator node(internal::mpi_node_comm(world));
+        const bool leader = node.rank() == 0;
+        ::boost::mpi::communicator leaders(world.split(leader ? 0 : 1));
+
+        ::MPI_Aint size = static_cast<::MPI_Aint>(leader ? bytes : 0);
+        int status = ::MPI_Win_allocate_shared(size,
+            static_cast<int>(sizeof(T)), MPI_INFO_NULL,
+            static_cast<MPI_Comm>(node), &data_, &win_);
+        internal::mpi_error_check(
+            status, "MPISharedData::assign", "::MPI_Win_allocate_shared");
+        if (!leader) {
+            int disp = 0;
+            status = ::MPI_Win_shared_query(win_, 0, &size, &disp, &data_);
+            internal::mpi_error_check(
+                status, "MPISharedData::assign", "::MPI_Win_shared_query");
+        }
+
+        ::MPI_Win_fence(0, win_);
+        if (leader) {
+            if (world.rank() == 0 && bytes != 0)
+                std::memcpy(data_, first, bytes);
+            broadcast(leaders, reinterpret_cast<char *>(data_), bytes);
+        }
+        ::MPI_Win_fence(0, win_);
+#else
+        local_.resize(n);
+        if (world.rank() == 0 && bytes != 0)
+            std::memcpy(local_.data(), first, bytes);
+        broadcast(world, reinterpret_cast<char *>(local_.data()), bytes);
+        data_ = local_.data();
+#endif
+    }
+
+    /// \brief Free the data collectively
+    void release()
+    {
+#if VSMC_MPI_HAS_SHARED_WINDOW
+        if (win_ != MPI_WIN_NULL)
+            ::MPI_Win_free(&win_);
+#else
+        local_.clear();
+#endif
+        win_ = MPI_WIN_NULL;
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    size_type size() const { return size_; }
+
+    const T *data() const { return data_; }
+
+    const T *begin() const { return data_; }
+
+    const T *end() const { return data_ + size_; }
+
+    const T &operator[](size_type i) const { return data_[i]; }
+
+    private:
+    ::MPI_Win win_;
+    T *data_;
+    size_type size_;
+#if !VSMC_MPI_HAS_SHARED_WINDOW
+    Vector<T> local_;
+#endif
+
+    // Broadcast raw bytes in chunks that fit into an int count
+    static void broadcast(
+        const ::boost::mpi::communicator &comm, char *first, std::size_t n)
+    {
+        const std::size_t chunk =
+            static_cast<std::size_t>(std::numeric_limits<int>::max());
+        while (n != 0) {
+            const std::size_t m = std::min(n, chunk);
+            ::MPI_Bcast(first, static_cast<int>(m), MPI_BYTE, 0,
+                static_cast<MPI_Comm>(comm));
+            first += m;
+            n -= m;
+        }
+    }
+}; // class MPISharedData
+
+} // namespace vsmc
+
+#endif // VSMC_MPI_MPI_SHARED_HPP
@@ -34,13 +34,20 @@
 
 #include <vsmc/opencl/internal/common.hpp>
 #include <vsmc/opencl/internal/cl_copy.hpp>
+#include <vsmc/opencl/internal/cl_reduce.hpp>
+#include <vsmc/opencl/internal/cl_resample.hpp>
 #include <vsmc/opencl/cl_buffer.hpp>
 #include <vsmc/opencl/cl_configure.hpp>
+#include <vsmc/opencl/cl_layout.hpp>
 #include <vsmc/opencl/cl_manager.hpp>
 #include <vsmc/opencl/cl_manip.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
 #include <vsmc/opencl/cl_query.hpp>
 #include <vsmc/opencl/cl_type.hpp>
+#include <vsmc/core/weight.hpp>
 #include <vsmc/rng/seed.hpp>
+#include <future>
+#include <memory>
 
 #define VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_DYNAMIC_STATE_SIZE_RESIZE(Dim)   \
     VSMC_STATIC_ASSERT((Dim == Dynamic),                                      \
@@ -59,6 +66,22 @@
 #define VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_STATE_SIZE(state_size)          \
     VSMC_RUNTIME_ASSERT((state_size >= 1), "STATE SIZE IS LESS THAN 1")
 
+#define VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_STATE_SIZE_LAYOUT(state_size)   \
+    VSMC_RUNTIME_ASSERT((!Layout::interleaved() ||                            \
+                            state_size % sizeof(RealType) == 0),              \
+        "**StateCL** STATE SIZE IS NOT A MULTIPLE OF sizeof(RealType) WITH "  \
+        "AN INTERLEAVED LAYOUT")
+
+#define VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_MULTI_DEVICE                   \
+    VSMC_RUNTIME_ASSERT((!Layout::interleaved() &&                            \
+                            manager().opencl_version() >= 120),               \
+        "**StateCL::multi_device** USED WITH AN INTERLEAVED LAYOUT OR "       \
+        "OPENCL VERSION BELOW 1.2")
+
+#define VSMC_RUNTIME_WARNING_OPENCL_BACKEND_CL_DEVICE_KERNEL                  \
+    VSMC_RUNTIME_WARNING(false,                                               \
+        "**StateCL::enqueue_device_kernel** FAILED TO ENQUEUE A KERNEL")
+
 #define VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_COPY_SIZE_MISMATCH              \
     VSMC_RUNTIME_ASSERT((N == copy_.size()), "**StateCL::copy** SIZE "        \
                                              "MISMATCH")
@@ -68,7 +91,7 @@
         "**StateCL::state_unpack** INPUT PACK SIZE TOO SMALL")
 
 #define VSMC_DEFINE_OPENCL_BACKEND_CL_SPECIAL(Name)                           \
-    Name() : build_id_(-1) {}                                                 \
+    Name() : build_id_(-1), device_(0) {}                                     \
     Name(const Name<T> &) = default;                                          \
     Name<T> &operator=(const Name<T> &) = default;                            \
     Name(Name<T> &&) = default;                                               \
@@ -79,6 +102,7 @@
     CLConfigure &configure() { return configure_; }                           \
     const CLConfigure &configure() const { return configure_; }               \
     const CLKernel &kernel() { return kernel_; }                              \
+    std::size_t device() const { return device_; }                            \
     const std::string &kernel_name() const { return kernel_name_; }
 
 #define VSMC_DEFINE_OPENCL_BACKEND_CL_SET_KERNEL                              \
@@ -92,12 +116,21 @@
         kernel_ = particle.value().create_kernel(kernel_name_);               \
         configure_.local_size(                                                \
             particle.size(), kernel_, particle.value().manager().device());   \
+        kernel_vec_.assign(1, kernel_);                                       \
+        if (particle.value().device_num() != 1) {                             \
+            kernel_vec_.clear();                                              \
+            for (std::size_t d = 0; d != particle.value().device_num(); ++d)  \
+                kernel_vec_.push_back(                                        \
+                    particle.value().create_kernel(kernel_name_, d));         \
+        }                                                                     \
     }
 
 #define VSMC_DEFINE_OPENCL_BACKEND_CL_MEMBER_DATA                             \
     CLConfigure configure_;                                                   \
     int build_id_;                                                            \
+    std::size_t device_;                                                      \
     CLKernel kernel_;                                                         \
+    std::vector<CLKernel> kernel_vec_;                                        \
     std::string kernel_name_
 
 namespace vsmc
@@ -106,41 +139,7 @@ namespace vsmc
 namespace internal
 {
 
-template <typename>
-void set_cl_fp_type(std::stringstream &);
-
-template <>
-inline void set_cl_fp_type<cl_float>(std::stringstream &ss)
-{
-    ss << "#ifndef FP_TYPE\n";
-    ss << "#define FP_TYPE float\n";
-    ss << "typedef float fp_type;\n";
-    ss << "#endif\n";
-
-    ss << "#ifndef VSMC_HAS_RNGC_DOUBLE\n";
-    ss << "#define VSMC_HAS_RNGC_DOUBLE 0\n";
-    ss << "#endif\n";
-}
-
-template <>
-inline void set_cl_fp_type<cl_double>(std::stringstream &ss)
-{
-    ss << "#if defined(cl_khr_fp64)\n";
-    ss << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
-    ss << "#elif defined(cl_amd_fp64)\n";
-    ss << "#pragma OPENCL EXTENSION cl_amd_fp64 : enable\n";
-    ss << "#endif\n";
-
-    ss << "#define FP_TYPE double\n";
-    ss << "typedef double fp_type;\n";
-    ss << "#endif\n";
-
-    ss << "#ifndef VSMC_HAS_RNGC_DOUBLE\n";
-    ss << "#define VSMC_HAS_RNGC_DOUBLE 1\n";
-    ss << "#endif\n";
-}
-
-template <typename RealType>
+template <typename RealType, typename Layout = CLLayoutAoS>
 inline std::string cl_source_macros(
     std::size_t size, std::size_t state_size, std::size_t seed)
 {
@@ -159,35 +158,464 @@ inline std::string cl_source_macros(
     ss << "#define SEED " << seed << "UL\n";
     ss << "#endif\n";
 
+    ss << "#ifndef STATE_DIM\n";
+    ss << "#define STATE_DIM " << state_size / sizeof(RealType) << "UL\n";
+    ss << "#endif\n";
+
+    ss << "#ifndef STATE_PADDED_SIZE\n";
+    ss << "#define STATE_PADDED_SIZE " << Layout::padded_size(size)
+       << "UL\n";
+    ss << "#endif\n";
+
+    Layout::define(ss, "STATE_LAYOUT_OFFSET");
+    ss << "#ifndef STATE_OFFSET\n";
+    ss << "#define STATE_OFFSET(i, k) "
+          "STATE_LAYOUT_OFFSET(i, k, STATE_PADDED_SIZE, STATE_DIM)\n";
+    ss << "#endif\n";
+
+    ss << "#ifndef STATE\n";
+    ss << "#define STATE(state, i, k) "
+          "(((__global fp_type *)(state))[STATE_OFFSET(i, k)])\n";
+    ss << "#endif\n";
+
     return ss.str();
 }
 
+/// \brief The sub-buffers of a buffer for each device, see
+/// StateCL::device_buffer
+struct CLDeviceBufferCache {
+    CLDeviceBufferCache() : build_id(-1), size(0) {}
+
+    CLMemory parent;
+    int build_id;
+    std::size_t size;
+    std::vector<CLMemory> sub;
+}; // struct CLDeviceBufferCache
+
 } // namespace vsmc::internal
 
+/// \brief Particle::weight_type subtype using OpenCL
+/// \ingroup OpenCL
+///
+/// \details
+/// The log weights are kept in a device buffer, `log_weight_buffer()`, and
+/// are normalized on the device, with work-group reductions computing the
+/// maximum and the sums needed by the ESS. The sums are accumulated in
+/// `double` if all devices support it, and in `RealType` otherwise. Only two
+/// scalars are read back per update. Normalized weights are read back
+/// lazily, when they are first accessed on the host after an update, e.g.,
+/// by resampling or a monitor that is not record only.
+///
+/// If every log weight is `-INFINITY`, they are all reset to zero, that is,
+/// the weights are equal, and the ESS is set to zero, instead of producing
+/// NaN.
+///
+/// Increments computed by kernels can be added without leaving the device,
+/// either by passing a buffer to `add_log`, or by letting a kernel update
+/// `log_weight_buffer()` in place and then calling `update()`. A value type
+/// selects this weight type through its `weight_type`. For example,
+/// ~~~{.cpp}
+/// class cv : public StateCL<StateSize, cl_float>
+/// {
+///     public:
+///     using weight_type = WeightCL<cl_float>;
+/// };
+/// ~~~
+template <typename RealType, typename ID = CLDefault>
+class WeightCL : public Weight
+{
+    public:
+    using size_type = SizeType<Weight>;
+    using fp_type = RealType;
+    using cl_id = ID;
+    using manager_type = CLManager<ID>;
+
+    explicit WeightCL(size_type N)
+        : Weight(N)
+        , ess_(static_cast<double>(N))
+        , local_size_(0)
+        , group_num_(0)
+        , fp64_(false)
+        , sync_(true)
+        , weight_(N)
+        , log_weight_buffer_(N)
+    {
+        VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_STATE_CL_FP_TYPE(RealType);
+
+        build();
+        set_equal();
+    }
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    /// \brief The device buffer of (unnormalized) log weights
+    const CLBuffer<RealType, ID> &log_weight_buffer() const
+    {
+        return log_weight_buffer_;
+    }
+
+    double ess() const { return ess_; }
+
+    const double *data() const
+    {
+        sync();
+
+        return weight_.data();
+    }
+
+    template <typename OutputIter>
+    void read_weight(OutputIter first) const
+    {
+        sync();
+        std::copy(weight_.begin(), weight_.end(), first);
+    }
+
+    template <typename RandomIter>
+    void read_weight(RandomIter first, int stride) const
+    {
+        sync();
+        for (std::size_t i = 0; i != weight_.size(); ++i, first += stride)
+            *first = weight_[i];
+    }
+
+    void read_resample_weight(double *first) const { read_weight(first); }
+
+    const double *resample_data() const { return data(); }
+
+    void set_equal()
+    {
+        const std::size_t N = static_cast<std::size_t>(this->size());
+        const ::cl_ulong n = static_cast<::cl_ulong>(N);
+        cl_set_kernel_args(kernel_zero_, 0, n, log_weight_buffer_.data());
+        manager().enqueue_run_kernel(kernel_zero_, N, event_);
+        manager().flush();
+
+        ess_ = static_cast<double>(N);
+        std::fill(weight_.begin(), weight_.end(), 1.0 / ess_);
+        sync_ = true;
+    }
+
+    /// \brief Set log weights from a device buffer of size `size()`
+    void set_log(const CLMemory &log_weight)
+    {
+        const ::cl_ulong n = static_cast<::cl_ulong>(this->size());
+        cl_set_kernel_args(
+            kernel_set_, 0, n, log_weight_buffer_.data(), log_weight);
+        manager().enqueue_run_kernel(kernel_set_, this->size(), event_);
+        update();
+    }
+
+    /// \brief Add log weight increments from a device buffer of size
+    /// `size()`
+    void add_log(const CLMemory &incr_weight)
+    {
+        const ::cl_ulong n = static_cast<::cl_ulong>(this->size());
+        cl_set_kernel_args(
+            kernel_add_, 0, n, log_weight_buffer_.data(), incr_weight);
+        manager().enqueue_run_kernel(kernel_add_, this->size(), event_);
+        update();
+    }
+
+    template <typename InputIter>
+    void set_log(InputIter first)
+    {
+        write_host(first, log_weight_buffer_, [](double w) { return w; });
+        update();
+    }
+
+    template <typename InputIter>
+    void add_log(InputIter first)
+    {
+        incr_buffer_.resize(this->size());
+        write_host(first, incr_buffer_, [](double w) { return w; });
+        add_log(incr_buffer_.data());
+    }
+
+    template <typename InputIter>
+    void set(InputIter first)
+    {
+        write_host(
+            first, log_weight_buffer_, [](double w) { return std::log(w); });
+        update();
+    }
+
+    template <typename InputIter>
+    void mul(InputIter first)
+    {
+        incr_buffer_.resize(this->size());
+        write_host(
+            first, incr_buffer_, [](double w) { return std::log(w); });
+        add_log(incr_buffer_.data());
+    }
+
+    /// \brief Normalize the log weights and compute the ESS on the device
+    ///
+    /// \details
+    /// This shall be called after a kernel changes `log_weight_buffer()`
+    /// in place. The buffer is shifted such that its maximum is zero, and
+    /// the sums of the weights and their squares are read back
+    void update()
+    {
+        const ::cl_ulong n = static_cast<::cl_ulong>(this->size());
+        const ::cl_ulong g = static_cast<::cl_ulong>(group_num_);
+        const std::size_t global_size = group_num_ * local_size_;
+
+        cl_set_kernel_args(kernel_max_, 0, n, log_weight_buffer_.data(),
+            partial_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_max_, global_size, event_, local_size_);
+        cl_set_kernel_args(kernel_max_, 0, g, partial_buffer_.data(),
+            result_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_max_, local_size_, event_, local_size_);
+        cl_set_kernel_args(kernel_sum_, 0, n, log_weight_buffer_.data(),
+            result_buffer_.data(), partial_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_sum_, global_size, event_, local_size_);
+        cl_set_kernel_args(kernel_sum_post_, 0, g, partial_buffer_.data(),
+            result_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_sum_post_, local_size_, event_, local_size_);
+
+        double result[2] = {0, 0};
+        read_result(result);
+        ess_ = result[0] > 0 ? result[0] * result[0] / result[1] : 0;
+        sync_ = false;
+    }
+
+    private:
+    double ess_;
+    std::size_t local_size_;
+    std::size_t group_num_;
+    bool fp64_;
+    mutable bool sync_;
+    mutable Vector<double> weight_;
+    mutable Vector<RealType> host_;
+
+    CLBuffer<RealType, ID> log_weight_buffer_;
+    CLBuffer<RealType, ID> incr_buffer_;
+    CLBuffer<char, ID> partial_buffer_;
+    CLBuffer<char, ID> result_buffer_;
+    CLEvent event_;
+
+    CLProgram program_;
+    CLKernel kernel_zero_;
+    CLKernel kernel_set_;
+    CLKernel kernel_add_;
+    CLKernel kernel_max_;
+    CLKernel kernel_sum_;
+    CLKernel kernel_sum_post_;
+
+    template <typename InputIter, typename UnaryOp>
+    void write_host(
+        InputIter first, const CLBuffer<RealType, ID> &buffer, UnaryOp op)
+    {
+        host_.resize(this->size());
+        for (auto &v : host_) {
+            v = static_cast<RealType>(op(static_cast<double>(*first)));
+            ++first;
+        }
+        manager().write_buffer(buffer.data(), host_.size(), host_.data());
+    }
+
+    // The sums of the weights and their squares, computed by update()
+    void read_result(double *result) const
+    {
+        if (fp64_) {
+            manager().read_buffer(result_buffer_.data(), 2, result);
+            return;
+        }
+
+        RealType r[2] = {0, 0};
+        manager().read_buffer(result_buffer_.data(), 2, r);
+        result[0] = static_cast<double>(r[0]);
+        result[1] = static_cast<double>(r[1]);
+    }
+
+    void sync() const
+    {
+        if (sync_)
+            return;
+
+        host_.resize(this->size());
+        manager().read_buffer(
+            log_weight_buffer_.data(), host_.size(), host_.data());
+        double coeff = 0;
+        for (std::size_t i = 0; i != host_.size(); ++i) {
+            weight_[i] = std::exp(static_cast<double>(host_[i]));
+            coeff += weight_[i];
+        }
+        coeff = 1 / coeff;
+        for (auto &w : weight_)
+            w *= coeff;
+        sync_ = true;
+    }
+
+    void build()
+    {
+        local_size_ = internal::cl_reduce_local_size(manager().device().get());
+        group_num_ = internal::cl_reduce_group_num(
+            static_cast<std::size_t>(this->size()), local_size_);
+        fp64_ = std::is_same<RealType, ::cl_double>::value ||
+            internal::cl_has_fp64(manager().device_vec());
+        const std::size_t acc_size =
+            fp64_ ? sizeof(double) : sizeof(RealType);
+        partial_buffer_.resize(group_num_ * 2 * acc_size);
+        result_buffer_.resize(2 * acc_size);
+
+        std::stringstream ss;
+        internal::set_cl_fp_type<RealType>(ss);
+        internal::set_cl_acc_type(ss, fp64_);
+        internal::cl_reduce_source(ss, local_size_);
+
+        ss << "__kernel void weight_zero (ulong n, __global fp_type *lw)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i < n) lw[i] = 0;\n";
+        ss << "}\n";
+
+        ss << "__kernel void weight_set (ulong n, __global fp_type *lw,\n";
+        ss << "                          __global const fp_type *src)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i < n) lw[i] = src[i];\n";
+        ss << "}\n";
+
+        ss << "__kernel void weight_add (ulong n, __global fp_type *lw,\n";
+        ss << "                          __global const fp_type *incr)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i < n) lw[i] += incr[i];\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void weight_max (ulong n, __global const fp_type *x,\n";
+        ss << "                 __global fp_type *r)\n";
+        ss << "{\n";
+        ss << "    __local fp_type buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    fp_type m = -INFINITY;\n";
+        ss << "    for (ulong i = get_global_id(0); i < n;\n";
+        ss << "         i += get_global_size(0))\n";
+        ss << "        m = fmax(m, x[i]);\n";
+        ss << "    buf[lid] = m;\n";
+        ss << "    VSMC_CL_REDUCE(\n";
+        ss << "        buf[lid] = fmax(buf[lid], buf[lid + s]))\n";
+        ss << "    if (lid == 0) r[get_group_id(0)] = buf[0];\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void weight_sum (ulong n, __global fp_type *lw,\n";
+        ss << "                 __global const fp_type *mx,\n";
+        ss << "                 __global acc_type *r)\n";
+        ss << "{\n";
+        ss << "    __local acc_type s1[LocalSize];\n";
+        ss << "    __local acc_type s2[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    fp_type m = mx[0];\n";
+        ss << "    int all_inf = m == -INFINITY;\n";
+        ss << "    acc_type a = 0;\n";
+        ss << "    acc_type b = 0;\n";
+        ss << "    for (ulong i = get_global_id(0); i < n;\n";
+        ss << "         i += get_global_size(0)) {\n";
+        ss << "        fp_type v = all_inf ? 0 : lw[i] - m;\n";
+        ss << "        acc_type w = all_inf ? 0 : exp((acc_type) v);\n";
+        ss << "        lw[i] = v;\n";
+        ss << "        a += w;\n";
+        ss << "        b += w * w;\n";
+        ss << "    }\n";
+        ss << "    s1[lid] = a;\n";
+        ss << "    s2[lid] = b;\n";
+        ss << "    VSMC_CL_REDUCE(\n";
+        ss << "        {s1[lid] += s1[lid + s]; s2[lid] += s2[lid + s];})\n";
+        ss << "    if (lid == 0) {\n";
+        ss << "        r[get_group_id(0) * 2] = s1[0];\n";
+        ss << "        r[get_group_id(0) * 2 + 1] = s2[0];\n";
+        ss << "    }\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void weight_sum_post (ulong n, __global const acc_type *x,\n";
+        ss << "                      __global acc_type *r)\n";
+        ss << "{\n";
+        ss << "    __local acc_type s1[LocalSize];\n";
+        ss << "    __local acc_type s2[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    acc_type a = 0;\n";
+        ss << "    acc_type b = 0;\n";
+        ss << "    for (ulong i = lid; i < n; i += LocalSize) {\n";
+        ss << "        a += x[i * 2];\n";
+        ss << "        b += x[i * 2 + 1];\n";
+        ss << "    }\n";
+        ss << "    s1[lid] = a;\n";
+        ss << "    s2[lid] = b;\n";
+        ss << "    VSMC_CL_REDUCE(\n";
+        ss << "        {s1[lid] += s1[lid + s]; s2[lid] += s2[lid + s];})\n";
+        ss << "    if (lid == 0) {\n";
+        ss << "        r[0] = s1[0];\n";
+        ss << "        r[1] = s2[0];\n";
+        ss << "    }\n";
+        ss << "}\n";
+
+        ::cl_int status = CL_SUCCESS;
+        program_ = CLProgramCache<ID>::instance().build(
+            ss.str(), std::string(), status);
+
+        kernel_zero_ = CLKernel(program_, "weight_zero");
+        kernel_set_ = CLKernel(program_, "weight_set");
+        kernel_add_ = CLKernel(program_, "weight_add");
+        kernel_max_ = CLKernel(program_, "weight_max");
+        kernel_sum_ = CLKernel(program_, "weight_sum");
+        kernel_sum_post_ = CLKernel(program_, "weight_sum_post");
+    }
+}; // class WeightCL
+
 /// \brief Particle::value_type subtype using OpenCL
 /// \ingroup OpenCL
-template <std::size_t StateSize, typename RealType, typename ID = CLDefault>
+///
+/// \details
+/// The layout of `state_buffer()` is determined by `Layout`, which is one
+/// of CLLayoutAoS (the default), CLLayoutSoA and CLLayoutAoSoA. With the
+/// latter two, the state of a particle is viewed as
+/// `StateSize / sizeof(RealType)` components of type `fp_type`, and kernels
+/// access component `k` of particle `i` as `STATE(state, i, k)`. The same
+/// macro works with the default layout as well, see `build`.
+///
+/// With the default layout, the particles can also be split across all
+/// devices of the CLManager, see `multi_device`.
+template <std::size_t StateSize, typename RealType, typename ID = CLDefault,
+    typename Layout = CLLayoutAoS>
 class StateCL
 {
     public:
     using size_type = ::cl_ulong;
     using fp_type = RealType;
     using cl_id = ID;
+    using layout_type = Layout;
     using manager_type = CLManager<ID>;
     using state_pack_type = Vector<char>;
 
     explicit StateCL(size_type N)
         : state_size_(StateSize == Dynamic ? 1 : StateSize)
         , size_(N)
+        , global_offset_(0)
+        , global_size_(N)
         , build_(false)
         , build_id_(0)
-        , state_buffer_(state_size_ * size_)
+        , build_os_(&std::cout)
+        , double_buffer_(false)
+        , multi_device_(false)
+        , device_offset_(1, 0)
+        , device_size_(1, N)
+        , state_buffer_(state_size_ * Layout::padded_size(N))
     {
+        VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_STATE_SIZE_LAYOUT(state_size_);
+
         if (manager().opencl_version() >= 120) {
             src_idx_buffer_.resize(
-                size_, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY);
+                size_ * 2, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY);
         } else {
-            src_idx_buffer_.resize(size_, CL_MEM_READ_ONLY);
+            src_idx_buffer_.resize(size_ * 2, CL_MEM_READ_WRITE);
         }
     }
 
@@ -202,21 +630,208 @@ class StateCL
             StateSize);
         VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_STATE_SIZE(state_size);
 
+        VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_STATE_SIZE_LAYOUT(state_size);
+
         state_size_ = state_size;
-        state_buffer_.resize(state_size_ * size_);
+        state_buffer_.resize(state_size_ * padded_size());
     }
 
     /// \brief Change state buffer flag (cause reallocation)
     void update_state(::cl_mem_flags flag)
     {
-        state_buffer_.resize(state_size_ * size_, flag);
+        state_buffer_.resize(state_size_ * padded_size(), flag);
     }
 
     /// \brief Change state buffer flag and host pointer (cause
     /// reallocation)
     void update_state(::cl_mem_flags flag, void *host_ptr)
     {
-        state_buffer_.resize(state_size_ * size_, flag, host_ptr);
+        state_buffer_.resize(state_size_ * padded_size(), flag, host_ptr);
+    }
+
+    /// \brief Set the global id of the first particle and the total number
+    /// of particles
+    ///
+    /// \details
+    /// When the particles are distributed, e.g., by StateMPI, this is used
+    /// to offset `SEED` such that random streams are keyed by the global
+    /// particle id. It shall be called before `build`.
+    void global_index(size_type offset, size_type global_size)
+    {
+        global_offset_ = offset;
+        global_size_ = global_size;
+    }
+
+    /// \brief The global id of the first particle
+    size_type global_offset() const { return global_offset_; }
+
+    /// \brief The total number of particles
+    size_type global_size() const { return global_size_; }
+
+    /// \brief Whether the particles are split across all devices
+    bool multi_device() const { return multi_device_; }
+
+    /// \brief Enable or disable splitting the particles across all devices
+    /// of `manager().device_vec()`
+    ///
+    /// \details
+    /// When enabled, the `d`th device holds particles `device_offset(d)` to
+    /// `device_offset(d) + device_size(d) - 1`, in proportion to its number
+    /// of compute units. Each offset is aligned such that the particles of a
+    /// device can be accessed through a sub-buffer, see `device_buffer`. The
+    /// InitializeCL and MoveCL kernels are then enqueued on the command queue
+    /// of each device, and run concurrently, see `enqueue_device_kernel`.
+    ///
+    /// The split is limited to these kernels and their `state` and `accept`
+    /// arguments. In particular,
+    /// - Additional kernel arguments set by the user are not split. Those
+    /// with one record per particle, such as a buffer of log weight
+    /// increments, shall be passed as `device_buffer(buffer, device(),
+    /// cache)`, since each kernel indexes particles from zero.
+    /// - MonitorEvalCL, PathEvalCL, `copy`, `resample` and WeightCL run on
+    /// `manager().command_queue()` only, for all particles. After a copy,
+    /// the particles of each device are migrated back to it, and later work
+    /// on `manager().command_queue()` waits for the migrations.
+    ///
+    /// This requires OpenCL 1.2 and the default layout. It shall be called
+    /// before `build`. For each device, a program is also built with `SIZE`
+    /// being `device_size(d)` and `SEED` offset by `device_offset(d)`, such
+    /// that kernels written for a single device work unchanged. This is done
+    /// by `build(source, flags, os)` and `build(source, flags, binary_dir,
+    /// os)` only. Other overloads leave the particles on a single device.
+    void multi_device(bool enable)
+    {
+        if (enable) {
+            VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_MULTI_DEVICE;
+        }
+
+        multi_device_ = enable;
+    }
+
+    /// \brief The number of devices the particles are split across
+    ///
+    /// \details
+    /// This is one unless `multi_device()` is enabled, there are multiple
+    /// devices, and the last build succeeded
+    std::size_t device_num() const { return device_size_.size(); }
+
+    /// \brief The id of the first particle on the `d`th device
+    size_type device_offset(std::size_t d) const { return device_offset_[d]; }
+
+    /// \brief The number of particles on the `d`th device
+    size_type device_size(std::size_t d) const { return device_size_[d]; }
+
+    /// \brief The particles of the `d`th device in `state_buffer()`
+    ///
+    /// \details
+    /// The sub-buffers are created once for each state buffer and build
+    CLMemory device_state_buffer(std::size_t d) const
+    {
+        return device_buffer(state_buffer_, d, device_state_cache_);
+    }
+
+    /// \brief The part of a buffer of `size()` records, one per particle,
+    /// that belongs to the `d`th device
+    ///
+    /// \details
+    /// If the particles are on a single device, or the `d`th device has no
+    /// particles, this is `buffer.data()`. Otherwise, a new sub-buffer is
+    /// created on each call.
+    template <typename U>
+    CLMemory device_buffer(const CLBuffer<U, ID> &buffer, std::size_t d) const
+    {
+        if (device_num() == 1 || device_size_[d] == 0)
+            return buffer.data();
+
+        const std::size_t bytes =
+            sizeof(U) * buffer.size() / static_cast<std::size_t>(size_);
+
+        return cl_sub_buffer(buffer.data(),
+            bytes * static_cast<std::size_t>(device_offset_[d]),
+            bytes * static_cast<std::size_t>(device_size_[d]));
+    }
+
+    /// \brief The same as `device_buffer(buffer, d)`, but the sub-buffers of
+    /// all devices are kept in `cache`
+    ///
+    /// \details
+    /// They are created only if `cache` was last used with another buffer,
+    /// or before the last build, such that a caller keeping `cache` creates
+    /// them once instead of in each step.
+    template <typename U>
+    CLMemory device_buffer(const CLBuffer<U, ID> &buffer, std::size_t d,
+        internal::CLDeviceBufferCache &cache) const
+    {
+        if (device_num() == 1 || device_size_[d] == 0)
+            return buffer.data();
+
+        if (cache.parent.get() != buffer.data().get() ||
+            cache.build_id != build_id_ || cache.size != buffer.size()) {
+            cache.parent = buffer.data();
+            cache.build_id = build_id_;
+            cache.size = buffer.size();
+            cache.sub.clear();
+            for (std::size_t k = 0; k != device_num(); ++k)
+                cache.sub.push_back(device_buffer(buffer, k));
+        }
+
+        return cache.sub[d];
+    }
+
+    /// \brief Enqueue one kernel per device, each for the particles of that
+    /// device
+    ///
+    /// \details
+    /// The `d`th kernel of `kern` shall be created by `create_kernel(name,
+    /// d)`, and its `d`th event is set in `events`. If the particles are on a
+    /// single device, `kern.front()` is enqueued for all of them. Otherwise,
+    /// the kernels wait for all work enqueued on `manager().command_queue()`
+    /// before, and work enqueued on the latter later waits for all of them.
+    /// A non-zero `local_size` is used on a device only if it does not exceed
+    /// the work-group size of the kernel on that device. Otherwise, the
+    /// preferred size of that device is used.
+    ///
+    /// \return The status of the first enqueue that fails, or
+    /// `CL_SUCCESS`. A failure is also reported by a runtime warning, since
+    /// the particles of that device are not updated
+    ::cl_int enqueue_device_kernel(const std::vector<CLKernel> &kern,
+        std::vector<CLEvent> &events, std::size_t local_size = 0)
+    {
+        events.resize(kern.size());
+        ::cl_int status = CL_SUCCESS;
+        if (device_num() == 1) {
+            status = manager().enqueue_run_kernel(
+                kern.front(), size_, events.front(), local_size);
+            if (status != CL_SUCCESS) {
+                VSMC_RUNTIME_WARNING_OPENCL_BACKEND_CL_DEVICE_KERNEL;
+            }
+            return status;
+        }
+
+        const std::vector<CLDevice> &dev = manager().device_vec();
+        CLEvent ready;
+        manager().enqueue_barrier(std::vector<CLEvent>(), ready);
+        for (std::size_t d = 0; d != device_num(); ++d) {
+            if (device_size_[d] == 0) {
+                events[d] = ready;
+                continue;
+            }
+            std::size_t local = local_size;
+            if (local > kern[d].work_group_size(dev[d]))
+                local = 0;
+            ::cl_int s = manager().enqueue_run_kernel(
+                d, kern[d], device_size_[d], events[d], local, {ready});
+            if (s != CL_SUCCESS) {
+                VSMC_RUNTIME_WARNING_OPENCL_BACKEND_CL_DEVICE_KERNEL;
+                events[d] = ready;
+                if (status == CL_SUCCESS)
+                    status = s;
+            }
+        }
+        CLEvent done;
+        manager().enqueue_barrier(events, done);
+
+        return status;
     }
 
     /// \brief The instance of the CLManager signleton associated
@@ -231,6 +846,13 @@ class StateCL
     /// collection
     const CLProgram &program() const { return program_; }
 
+    /// \brief The OpenCL program built for the `d`th device, see
+    /// `multi_device`
+    const CLProgram &program(std::size_t d) const
+    {
+        return device_program_.size() == 0 ? program_ : device_program_[d];
+    }
+
     /// \brief Build the OpenCL program from source
     ///
     /// \param source The source of the program
@@ -264,23 +886,45 @@ class StateCL
     /// #ifndef SEED
     /// #define SEED 101UL;
     /// #endif
-    /// // The actual seed is vsmc::Seed::instance().get()
+    /// // The actual seed is vsmc::Seed::instance().get() + global_offset()
+    ///
+    /// #ifndef STATE_DIM
+    /// #define STATE_DIM 1UL // StateSize / sizeof(fp_type)
+    /// #endif
+    ///
+    /// #ifndef STATE_PADDED_SIZE
+    /// #define STATE_PADDED_SIZE 1000UL // Layout::padded_size(SIZE)
+    /// #endif
+    ///
+    /// // Layout specific macros, e.g., STATE_LAYOUT_AOS, followed by
+    /// // STATE_OFFSET(i, k), the offset of component k of particle i in
+    /// // units of fp_type, and STATE(state, i, k), that component itself
     /// // ... User source, passed by the source argument
     /// ~~~
     /// After build, `vsmc::Seed::instance().skip(N)` is called with `N` being
-    /// the nubmer of particles.
+    /// the total nubmer of particles, `global_size()`. Therefore, if the
+    /// kernels seed the RNG of the `i`th particle with `SEED + i`, each
+    /// particle has its own stream keyed by its global id.
+    ///
+    /// If CLProgramCache is enabled, the binaries of a previous build of the
+    /// same complete source and flags are used instead of compiling again.
     template <typename CharT, typename Traits>
     void build(const std::string &source, const std::string &flags,
         std::basic_ostream<CharT, Traits> &os)
     {
         VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_STATE_CL_FP_TYPE(fp_type);
 
-        std::string src(internal::cl_source_macros<fp_type>(
-                            size_, state_size_, Seed::instance().get()) +
+        const std::size_t seed =
+            static_cast<std::size_t>(Seed::instance().get() + global_offset_);
+        std::string src(internal::cl_source_macros<fp_type, Layout>(
+                            size_, state_size_, seed) +
             source);
-        Seed::instance().skip(static_cast<Seed::skip_type>(size_));
-        program_ = manager().create_program(src);
-        build_program(flags, os);
+        Seed::instance().skip(static_cast<Seed::skip_type>(global_size_));
+        ::cl_int status = CL_SUCCESS;
+        build_join();
+        program_ = CLProgramCache<ID>::instance().build(src, flags, status);
+        build_report(status, os);
+        build_device(source, flags, seed, os);
     }
 
     void build(
@@ -289,6 +933,133 @@ class StateCL
         build(source, flags, std::cout);
     }
 
+    /// \brief Build the OpenCL program, using binaries compiled ahead of time
+    /// if possible
+    ///
+    /// \param source The source of the program
+    /// \param flags The OpenCL compiler flags
+    /// \param binary_dir The directory of binaries compiled ahead of time
+    /// by the `VSMC_OPENCL_COMPILE` CMake function
+    /// \param os The output stream to write the output when error occurs
+    ///
+    /// \details
+    /// The binaries are used only if they were compiled for the same complete
+    /// source, that is with the same `SIZE`, `STATE_SIZE`, `SEED` and
+    /// `fp_type`, the same flags, and the same devices and drivers.
+    /// Otherwise the program is built from `source` as by `build(source,
+    /// flags, os)`.
+    template <typename CharT, typename Traits>
+    void build(const std::string &source, const std::string &flags,
+        const std::string &binary_dir, std::basic_ostream<CharT, Traits> &os)
+    {
+        VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_STATE_CL_FP_TYPE(fp_type);
+
+        const std::size_t seed =
+            static_cast<std::size_t>(Seed::instance().get() + global_offset_);
+        std::string src(internal::cl_source_macros<fp_type, Layout>(
+                            size_, state_size_, seed) +
+            source);
+        Seed::instance().skip(static_cast<Seed::skip_type>(global_size_));
+        ::cl_int status = CL_SUCCESS;
+        build_join();
+        program_ = CLProgramCache<ID>::instance().build(
+            binary_dir, src, flags, status);
+        build_report(status, os);
+        build_device(source, flags, seed, os);
+    }
+
+    void build(const std::string &source, const std::string &flags,
+        const std::string &binary_dir)
+    {
+        build(source, flags, binary_dir, std::cout);
+    }
+
+    /// \brief Build the OpenCL program from the model source and library
+    /// modules compiled separately
+    ///
+    /// \param source The source of the model, prefixed with the same macros
+    /// as `build(source, flags, os)`
+    /// \param modules The sources of library modules, each prefixed with the
+    /// `FP_TYPE` macros only
+    /// \param flags The OpenCL compiler flags, e.g., `-I`
+    /// \param os The output stream to write the output when error
+    /// occurs
+    ///
+    /// \details
+    /// Each module is compiled with `clCompileProgram` only once per context
+    /// (see CLProgramCache::compile), and linked with the model source, which
+    /// is compiled on each call. A module shall define functions with
+    /// external linkage, whose prototypes are declared in the model source.
+    /// Functions defined `static inline` in headers, such as those of
+    /// `vsmc/rngc`, are still compiled with each module including them, and
+    /// shall be wrapped by such functions in a module to benefit.
+    ///
+    /// If the devices do not support OpenCL 1.2, the modules and the source
+    /// are concatenated and built as by `build(source, flags, os)`.
+    template <typename CharT, typename Traits>
+    void build(const std::string &source,
+        const std::vector<std::string> &modules, const std::string &flags,
+        std::basic_ostream<CharT, Traits> &os)
+    {
+        VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_STATE_CL_FP_TYPE(fp_type);
+
+        std::string macros(internal::cl_source_macros<fp_type, Layout>(size_,
+            state_size_, Seed::instance().get() + global_offset_));
+        Seed::instance().skip(static_cast<Seed::skip_type>(global_size_));
+        CLProgramCache<ID> &cache = CLProgramCache<ID>::instance();
+        ::cl_int status = CL_SUCCESS;
+        build_join();
+
+        if (manager().opencl_version() < 120) {
+            std::string src(macros);
+            for (const auto &m : modules)
+                src += m;
+            src += source;
+            program_ = cache.build(src, flags, status);
+            build_report(status, os);
+            return;
+        }
+
+        std::stringstream ss;
+        internal::set_cl_fp_type<fp_type>(ss);
+        std::vector<CLProgram> programs;
+        for (const auto &m : modules) {
+            programs.push_back(cache.compile(ss.str() + m, flags, status));
+            if (status != CL_SUCCESS) {
+                program_ = programs.back();
+                build_report(status, os);
+                return;
+            }
+        }
+
+        program_ = manager().create_program(macros + source);
+        status = program_.compile(manager().device_vec(), flags,
+            std::vector<std::pair<CLProgram, std::string>>());
+        if (status != CL_SUCCESS) {
+            build_report(status, os);
+            return;
+        }
+        programs.push_back(program_);
+
+        // A program that fails to link is kept for its log. If none is
+        // created, the logs of the compiled model source are reported
+        program_ = CLProgram(manager().context(), manager().device_vec(),
+            std::string(), programs, status);
+        if (!bool(program_)) {
+            program_ = programs.back();
+            if (status == CL_SUCCESS)
+                status = CL_LINK_PROGRAM_FAILURE;
+        }
+        build_report(status, os);
+    }
+
+    void build(const std::string &source,
+        const std::vector<std::string> &modules,
+        const std::string &flags = std::string())
+    {
+        build(source, modules, flags, std::cout);
+    }
+
     /// \brief Build from an existing program
     template <typename CharT, typename Traits>
     void build(const CLProgram &program, const std::string &flags,
@@ -304,15 +1075,95 @@ class StateCL
         build(program, flags, std::cout);
     }
 
+    /// \brief Start building the OpenCL program from source in the
+    /// background
+    ///
+    /// \details
+    /// The source is the same as `build(source, flags, os)`, and is built
+    /// through CLProgramCache on another thread. This function returns
+    /// immediately, such that the host can read data or allocate buffers
+    /// while the program compiles. The returned future becomes ready with the
+    /// build status.
+    ///
+    /// The build is finalized, and any error written to `os`, by
+    /// build_wait(), which is called by the non-const build(), build_id()
+    /// and create_kernel(). Therefore kernels are created lazily by the
+    /// `*CL` functors when they are first used. A later build, synchronous or
+    /// not, discards the result of a pending one, but waits for it to finish
+    /// before building, such that builds of the same object never use
+    /// CLProgramCache concurrently. The destructor also waits for it.
+    std::shared_future<::cl_int> build_async(const std::string &source,
+        const std::string &flags = std::string(), std::ostream &os = std::cout)
+    {
+        VSMC_STATIC_ASSERT_OPENCL_BACKEND_CL_STATE_CL_FP_TYPE(fp_type);
+
+        std::string src(
+            internal::cl_source_macros<fp_type, Layout>(size_, state_size_,
+                Seed::instance().get() + global_offset_) +
+            source);
+        Seed::instance().skip(static_cast<Seed::skip_type>(global_size_));
+
+        build_join();
+        std::shared_ptr<CLProgram> program(std::make_shared<CLProgram>());
+        build_os_ = &os;
+        build_async_ = program;
+        auto task = [program, src, flags]() {
+            ::cl_int status = CL_SUCCESS;
+            *program =
+                CLProgramCache<ID>::instance().build(src, flags, status);
+
+            return status;
+        };
+        build_future_ = std::async(std::launch::async, task).share();
+
+        return build_future_;
+    }
+
+    /// \brief Wait for a build started by build_async() and finalize it
+    ///
+    /// \details
+    /// It does nothing if there is no pending build
+    void build_wait()
+    {
+        if (!build_future_.valid())
+            return;
+
+        ::cl_int status = build_future_.get();
+        build_future_ = std::shared_future<::cl_int>();
+        program_ = std::move(*build_async_);
+        build_report(status, *build_os_);
+    }
+
     /// \brief Whether the last attempted building success
+    ///
+    /// \details
+    /// This does not wait for a pending build_async()
     bool build() const { return build_; }
 
+    /// \brief Whether the last attempted building success, after waiting for
+    /// a pending build_async()
+    bool build()
+    {
+        build_wait();
+
+        return build_;
+    }
+
     /// \brief The build id of the last attempted of building
     ///
     /// \details
     /// This function returns a non-decreasing sequence of integers
     int build_id() const { return build_id_; }
 
+    /// \brief The build id of the last attempted of building, after waiting
+    /// for a pending build_async()
+    int build_id()
+    {
+        build_wait();
+
+        return build_id_;
+    }
+
     /// \brief Create kernel with the current program
     ///
     /// \details
@@ -325,18 +1176,136 @@ class StateCL
         return CLKernel(program_, name);
     }
 
+    /// \brief Create kernel with the current program, after waiting for a
+    /// pending build_async()
+    CLKernel create_kernel(const std::string &name)
+    {
+        build_wait();
+        VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_BUILD(create_kernel);
+
+        return CLKernel(program_, name);
+    }
+
+    /// \brief Create kernel with the program of the `d`th device, see
+    /// `multi_device`
+    CLKernel create_kernel(const std::string &name, std::size_t d)
+    {
+        build_wait();
+        VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_BUILD(create_kernel);
+
+        return CLKernel(program(d), name);
+    }
+
     template <typename IntType>
     void copy(size_type N, const IntType *src_idx)
     {
         VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_COPY_SIZE_MISMATCH;
 
-        manager().template write_buffer<size_type>(
-            src_idx_buffer_.data(), N, src_idx);
-        copy_(src_idx_buffer_.data(), state_buffer_.data());
+        // The previous write may still be reading from the staging vector,
+        // and the previous copy may still be reading from the buffer
+        std::vector<CLEvent> wait_list;
+        if (src_idx_event_.get() != nullptr)
+            src_idx_event_.wait();
+        if (copy_event_.get() != nullptr)
+            wait_list.push_back(copy_event_);
+
+        if (double_buffer_) {
+            src_idx_host_.resize(N);
+            std::copy(src_idx, src_idx + N, src_idx_host_.begin());
+            manager().enqueue_write_buffer(src_idx_buffer_.data(), N,
+                src_idx_host_.data(), src_idx_event_, 0, wait_list);
+            copy_next();
+            manager().flush();
+            return;
+        }
+
+        // Only particles that change are uploaded, as pairs of destination
+        // and source indices
+        src_idx_host_.resize(N * 2);
+        size_type M = 0;
+        for (size_type dst = 0; dst != N; ++dst) {
+            const size_type src = static_cast<size_type>(src_idx[dst]);
+            if (src != dst) {
+                src_idx_host_[M * 2] = dst;
+                src_idx_host_[M * 2 + 1] = src;
+                ++M;
+            }
+        }
+        if (M == 0)
+            return;
+
+        manager().enqueue_write_buffer(src_idx_buffer_.data(), M * 2,
+            src_idx_host_.data(), src_idx_event_, 0, wait_list);
+        copy_.copy_compact(src_idx_buffer_.data(), M, state_buffer_.data(),
+            copy_event_, {src_idx_event_});
+        device_migrate();
+        manager().flush();
+    }
+
+    /// \brief Whether `copy` is done out of place
+    ///
+    /// \details
+    /// By default, `copy` is done in place, and only the particles whose
+    /// source is not themselves are copied. This requires that a particle
+    /// which is the source of another is also its own source, as is the case
+    /// for indices produced by the resampling algorithms on the host. When
+    /// double buffering is enabled, all states are copied into a second
+    /// buffer which is then swapped with `state_buffer()`, and any `src_idx`
+    /// can be used. The second buffer is allocated with `CL_MEM_READ_WRITE`,
+    /// and thus flags set by `update_state` are not preserved after a copy.
+    bool double_buffer() const { return double_buffer_; }
+
+    /// \brief Enable or disable out of place `copy`
+    void double_buffer(bool enable) { double_buffer_ = enable; }
+
+    /// \brief Sum a device buffer of `N` acceptance counts
+    ///
+    /// \details
+    /// The sum is computed by a work-group reduction after the events in
+    /// `event_wait_list`, and only the resulting scalar is read back
+    ::cl_ulong accept_count(const CLMemory &accept, size_type N,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        return reduce_(accept, static_cast<std::size_t>(N), event_wait_list);
+    }
+
+    /// \brief Resample on the device and copy the states
+    ///
+    /// \details
+    /// The parent indices are drawn by `scheme` from `log_weight`, a buffer
+    /// of `size()` log weights whose maximum is zero, such as
+    /// `WeightCL::log_weight_buffer()`. They are written directly into the
+    /// buffer used by `copy`, and neither the weights nor the indices are
+    /// transferred to the host. Since the parents drawn on the device are
+    /// not kept in place, the states are always copied out of place, as if
+    /// `double_buffer()` were enabled. The caller is responsible for setting
+    /// the weights equal afterwards
+    void resample(ResampleScheme scheme, const CLMemory &log_weight)
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_BACKEND_CL_BUILD(resample);
+
+        if (resample_.size() != size_)
+            resample_.build(size_);
+
+        std::vector<CLEvent> wait_list;
+        if (src_idx_event_.get() != nullptr)
+            wait_list.push_back(src_idx_event_);
+        if (copy_event_.get() != nullptr)
+            wait_list.push_back(copy_event_);
+        resample_(scheme, log_weight, src_idx_buffer_.data(),
+            static_cast<::cl_ulong>(Seed::instance().get() + global_offset_),
+            src_idx_event_, wait_list);
+        Seed::instance().skip(static_cast<Seed::skip_type>(global_size_));
+        copy_next();
+        manager().flush();
     }
 
     void copy_pre()
     {
+        // The host arrays back the buffers read by the previous copy_post
+        if (copy_post_event_.get() != nullptr)
+            copy_post_event_.wait();
+
         state_idx_host_.resize(size_);
         if (manager().opencl_version() >= 120) {
             state_idx_buffer_.resize(size_, CL_MEM_READ_ONLY |
@@ -348,30 +1317,45 @@ class StateCL
                 state_idx_host_.data());
         }
 
-        state_tmp_host_.resize(size_ * state_size_);
-        state_tmp_buffer_.resize(size_ * state_size_,
+        state_tmp_host_.resize(padded_size() * state_size_);
+        state_tmp_buffer_.resize(padded_size() * state_size_,
             CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, state_tmp_host_.data());
 
         std::memset(state_idx_host_.data(), 0, size_);
-        manager().read_buffer(
-            state_buffer_.data(), size_ * state_size_, state_tmp_host_.data());
+        manager().read_buffer(state_buffer_.data(), state_tmp_host_.size(),
+            state_tmp_host_.data());
     }
 
     void copy_post()
     {
         manager().write_buffer(
             state_idx_buffer_.data(), size_, state_idx_host_.data());
-        manager().write_buffer(state_tmp_buffer_.data(), size_ * state_size_,
-            state_tmp_host_.data());
+        manager().write_buffer(state_tmp_buffer_.data(),
+            state_tmp_host_.size(), state_tmp_host_.data());
         copy_(state_idx_buffer_.data(), state_tmp_buffer_.data(),
-            state_buffer_.data());
+            state_buffer_.data(), copy_event_);
+        copy_post_event_ = copy_event_;
+        device_migrate();
+        manager().flush();
     }
 
     state_pack_type state_pack(size_type id) const
     {
         state_pack_type pack(this->state_size());
-        std::memcpy(pack.data(), state_tmp_host_.data() + id * state_size_,
-            state_size_);
+        if (!Layout::interleaved()) {
+            std::memcpy(pack.data(),
+                state_tmp_host_.data() + id * state_size_, state_size_);
+            return pack;
+        }
+
+        const std::size_t n = padded_size();
+        const std::size_t d = state_size_ / sizeof(RealType);
+        for (std::size_t k = 0; k != d; ++k) {
+            std::memcpy(pack.data() + k * sizeof(RealType),
+                state_tmp_host_.data() +
+                    Layout::offset(id, k, n, d) * sizeof(RealType),
+                sizeof(RealType));
+        }
 
         return pack;
     }
@@ -382,8 +1366,19 @@ class StateCL
             pack.size(), state_size_);
 
         state_idx_host_[id] = 1;
-        std::memcpy(state_tmp_host_.data() + id * state_size_, pack.data(),
-            state_size_);
+        if (!Layout::interleaved()) {
+            std::memcpy(state_tmp_host_.data() + id * state_size_,
+                pack.data(), state_size_);
+            return;
+        }
+
+        const std::size_t n = padded_size();
+        const std::size_t d = state_size_ / sizeof(RealType);
+        for (std::size_t k = 0; k != d; ++k) {
+            std::memcpy(state_tmp_host_.data() +
+                    Layout::offset(id, k, n, d) * sizeof(RealType),
+                pack.data() + k * sizeof(RealType), sizeof(RealType));
+        }
     }
 
     CLConfigure &copy_configure() { return copy_.configure(); }
@@ -395,29 +1390,194 @@ class StateCL
     private:
     std::size_t state_size_;
     size_type size_;
+    size_type global_offset_;
+    size_type global_size_;
 
     CLProgram program_;
 
     bool build_;
     int build_id_;
-
+    std::ostream *build_os_;
+    std::shared_ptr<CLProgram> build_async_;
+    std::shared_future<::cl_int> build_future_;
+    std::vector<std::shared_future<::cl_int>> build_discarded_;
+
+    bool double_buffer_;
+    bool multi_device_;
+    std::vector<size_type> device_offset_;
+    std::vector<size_type> device_size_;
+    std::vector<CLProgram> device_program_;
     CLBuffer<char, ID> state_buffer_;
+    CLBuffer<char, ID> state_next_buffer_;
+    mutable internal::CLDeviceBufferCache device_state_cache_;
+    mutable internal::CLDeviceBufferCache device_state_next_cache_;
     CLBuffer<size_type, ID> src_idx_buffer_;
-    internal::CLCopy<ID> copy_;
+    Vector<size_type> src_idx_host_;
+    CLEvent src_idx_event_;
+    CLEvent copy_event_;
+    CLEvent copy_post_event_;
+    internal::CLCopy<ID, Layout> copy_;
+    internal::CLResample<RealType, ID> resample_;
+    internal::CLReduce<ID> reduce_;
 
     CLBuffer<char, ID> state_idx_buffer_;
     CLBuffer<char, ID> state_tmp_buffer_;
     Vector<char> state_idx_host_;
     Vector<char> state_tmp_host_;
 
+    std::size_t padded_size() const
+    {
+        return Layout::padded_size(static_cast<std::size_t>(size_));
+    }
+
+    // Copy out of place with the indices in src_idx_buffer_, and swap
+    void copy_next()
+    {
+        if (state_next_buffer_.size() != state_buffer_.size())
+            state_next_buffer_.resize(state_buffer_.size());
+        copy_.copy_next(src_idx_buffer_.data(), state_buffer_.data(),
+            state_next_buffer_.data(), copy_event_, {src_idx_event_});
+        std::swap(state_buffer_, state_next_buffer_);
+        std::swap(device_state_cache_, device_state_next_cache_);
+        device_migrate();
+    }
+
+    // Migrate the particles of each device back to it after a copy on the
+    // primary command queue, which then waits for the migrations, such that
+    // later work on it does not change the states while they are moved
+    void device_migrate()
+    {
+        if (device_num() == 1)
+            return;
+
+        std::vector<CLEvent> events;
+        for (std::size_t d = 0; d != device_num(); ++d) {
+            if (device_size_[d] == 0)
+                continue;
+            CLEvent event;
+            if (manager().enqueue_migrate_buffer(d, {device_state_buffer(d)},
+                    event, 0, {copy_event_}) == CL_SUCCESS) {
+                events.push_back(std::move(event));
+            }
+        }
+        if (events.size() != 0)
+            manager().enqueue_barrier(events, copy_event_);
+    }
+
+    // Split the particles across all devices in proportion to their compute
+    // units, or put all of them on a single device
+    void partition(bool split)
+    {
+        const std::vector<CLDevice> &dev = manager().device_vec();
+        const std::size_t D = split ? dev.size() : 1;
+        device_offset_.assign(D, 0);
+        device_size_.assign(D, size_);
+        if (D == 1)
+            return;
+
+        // Offsets are multiples of the largest base address alignment, in
+        // bytes, such that sub-buffers of records of any size are aligned
+        size_type align = 1;
+        std::vector<double> units(D);
+        double total = 0;
+        for (std::size_t d = 0; d != D; ++d) {
+            ::cl_uint bits = 0;
+            ::cl_uint cu = 1;
+            dev[d].get_info(CL_DEVICE_MEM_BASE_ADDR_ALIGN, bits);
+            dev[d].get_info(CL_DEVICE_MAX_COMPUTE_UNITS, cu);
+            align = std::max(align, static_cast<size_type>(bits / 8));
+            units[d] = static_cast<double>(std::max(cu, 1U));
+            total += units[d];
+        }
+
+        double acc = 0;
+        for (std::size_t d = 1; d != D; ++d) {
+            acc += units[d - 1];
+            size_type offset = static_cast<size_type>(
+                static_cast<double>(size_) * acc / total);
+            offset = std::max(offset / align * align, device_offset_[d - 1]);
+            device_offset_[d] = std::min(offset, size_);
+        }
+        for (std::size_t d = 0; d != D; ++d) {
+            const size_type last = d + 1 == D ? size_ : device_offset_[d + 1];
+            device_size_[d] = last - device_offset_[d];
+        }
+    }
+
+    // Build a program for each device with its own SIZE and SEED
+    template <typename CharT, typename Traits>
+    void build_device(const std::string &source, const std::string &flags,
+        std::size_t seed, std::basic_ostream<CharT, Traits> &os)
+    {
+        const std::vector<CLDevice> &dev = manager().device_vec();
+        if (!build_ || !multi_device_ || dev.size() < 2)
+            return;
+
+        partition(true);
+        for (std::size_t d = 0; d != device_num(); ++d) {
+            // Kernels of a device without particles are never enqueued
+            if (device_size_[d] == 0) {
+                device_program_.push_back(program_);
+                continue;
+            }
+            device_program_.push_back(manager().create_program(
+                internal::cl_source_macros<fp_type, Layout>(device_size_[d],
+                    state_size_, seed + device_offset_[d]) +
+                source));
+            ::cl_int status = device_program_.back().build(
+                std::vector<CLDevice>(1, dev[d]), flags);
+            if (status != CL_SUCCESS) {
+                std::string name;
+                dev[d].get_info(CL_DEVICE_NAME, name);
+                os << "Build failure for " << name << std::endl;
+                os << device_program_.back().build_log(dev[d]) << std::endl;
+                device_program_.clear();
+                partition(false);
+                build_ = false;
+                return;
+            }
+        }
+    }
+
+    // Discard the result of a pending build_async() without waiting for it.
+    // Its future is kept until the next build or the destruction of the
+    // object, since releasing the last reference to the state of std::async
+    // blocks until the task finishes
+    void build_discard()
+    {
+        build_async_.reset();
+        if (!build_future_.valid())
+            return;
+
+        build_discarded_.push_back(std::move(build_future_));
+        build_future_ = std::shared_future<::cl_int>();
+    }
+
+    // Discard a pending build_async() and wait for all discarded ones
+    void build_join()
+    {
+        build_discard();
+        for (const auto &future : build_discarded_)
+            future.wait();
+        build_discarded_.clear();
+    }
+
     template <typename CharT, typename Traits>
     void build_program(
         const std::string flags, std::basic_ostream<CharT, Traits> &os)
     {
+        build_report(program_.build(manager().device_vec(), flags), os);
+    }
+
+    template <typename CharT, typename Traits>
+    void build_report(::cl_int status, std::basic_ostream<CharT, Traits> &os)
+    {
+        build_discard();
         ++build_id_;
+        device_program_.clear();
+        partition(false);
 
         build_ = false;
-        ::cl_int status = program_.build(manager().device_vec(), flags);
         if (status != CL_SUCCESS) {
             std::vector<CLDevice> dev_vec(program_.get_device());
             std::string equal(75, '=');
@@ -436,7 +1596,7 @@ class StateCL
             os << equal << std::endl;
             return;
         }
-        copy_.build(size_, state_size_);
+        copy_.build(size_, state_size_, sizeof(RealType));
         build_ = true;
     }
 }; // class StateCL
@@ -471,6 +1631,11 @@ class StateCL
 /// In summary, on the host side, it is a `cl::Buffer` object being
 /// passed to
 /// the kernel, which is not much unlike `void *` pointer.
+///
+/// If StateCL::multi_device is enabled, `set_kernel_args`, `eval_param` and
+/// `eval_pre` are called once for each device, with `device()` and
+/// `kernel()` referring to it, and `state` and `accept` only contain the
+/// particles of that device.
 template <typename T>
 class InitializeCL
 {
@@ -490,11 +1655,15 @@ class InitializeCL
         if (kernel_name_.empty())
             return 0;
 
-        set_kernel_args(particle);
-        eval_param(particle, param);
-        eval_pre(particle);
-        particle.value().manager().run_kernel(
-            kernel_, particle.size(), configure_.local_size());
+        for (device_ = 0; device_ != kernel_vec_.size(); ++device_) {
+            kernel_ = kernel_vec_[device_];
+            set_kernel_args(particle);
+            eval_param(particle, param);
+            eval_pre(particle);
+        }
+        particle.value().enqueue_device_kernel(
+            kernel_vec_, kernel_event_vec_, configure_.local_size());
+        particle.value().manager().flush();
         eval_post(particle);
 
         return accept_count(particle, accept_buffer_.data());
@@ -505,14 +1674,18 @@ class InitializeCL
     virtual void eval_pre(Particle<T> &) {}
     virtual void eval_post(Particle<T> &) {}
 
+    /// \brief Count the number of accepted particles
+    ///
+    /// \details
+    /// The default implementation sums the accept buffer on the device once
+    /// the kernel is finished, see `StateCL::accept_count`. Reading back the
+    /// single sum is the only host synchronization of the step unless
+    /// `eval_post` waits itself.
     virtual std::size_t accept_count(
-        Particle<T> &particle, const CLMemory &accept_buffer)
+        Particle<T> &particle, const CLMemory &accept)
     {
-        particle.value().manager().read_buffer(
-            accept_buffer, particle.size(), accept_host_.data());
-
-        return static_cast<std::size_t>(std::accumulate(accept_host_.begin(),
-            accept_host_.end(), static_cast<::cl_ulong>(0)));
+        return static_cast<std::size_t>(particle.value().accept_count(
+            accept, particle.size(), kernel_event_vec_));
     }
 
     virtual void set_kernel(Particle<T> &particle)
@@ -524,17 +1697,16 @@ class InitializeCL
 
     virtual void set_kernel_args(Particle<T> &particle)
     {
-        accept_host_.resize(particle.size());
         if (particle.value().manager().opencl_version() >= 120) {
-            accept_buffer_.resize(particle.size(), CL_MEM_READ_WRITE |
-                    CL_MEM_HOST_READ_ONLY | CL_MEM_USE_HOST_PTR,
-                accept_host_.data());
+            accept_buffer_.resize(
+                particle.size(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY);
         } else {
-            accept_buffer_.resize(particle.size(),
-                CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, accept_host_.data());
+            accept_buffer_.resize(particle.size(), CL_MEM_READ_WRITE);
         }
-        cl_set_kernel_args(kernel_, 0, particle.value().state_buffer().data(),
-            accept_buffer_.data());
+        cl_set_kernel_args(kernel_, 0,
+            particle.value().device_state_buffer(device_),
+            particle.value().device_buffer(
+                accept_buffer_, device_, accept_cache_));
     }
 
     VSMC_DEFINE_OPENCL_BACKEND_CL_CONFIGURE_KERNEL
@@ -545,7 +1717,8 @@ class InitializeCL
     private:
     VSMC_DEFINE_OPENCL_BACKEND_CL_MEMBER_DATA;
     CLBuffer<::cl_ulong, typename T::cl_id> accept_buffer_;
-    std::vector<::cl_ulong> accept_host_;
+    internal::CLDeviceBufferCache accept_cache_;
+    std::vector<CLEvent> kernel_event_vec_;
 }; // class InitializeCL
 
 /// \brief Sampler<T>::move_type subtype using OpenCL
@@ -559,6 +1732,9 @@ class InitializeCL
 /// ulong
 /// *accept);
 /// ~~~
+///
+/// If StateCL::multi_device is enabled, `set_kernel_args` and `eval_pre` are
+/// called once for each device, as with InitializeCL
 template <typename T>
 class MoveCL
 {
@@ -578,10 +1754,14 @@ class MoveCL
         if (kernel_name_.empty())
             return 0;
 
-        set_kernel_args(iter, particle);
-        eval_pre(iter, particle);
-        particle.value().manager().run_kernel(
-            kernel_, particle.size(), configure_.local_size());
+        for (device_ = 0; device_ != kernel_vec_.size(); ++device_) {
+            kernel_ = kernel_vec_[device_];
+            set_kernel_args(iter, particle);
+            eval_pre(iter, particle);
+        }
+        particle.value().enqueue_device_kernel(
+            kernel_vec_, kernel_event_vec_, configure_.local_size());
+        particle.value().manager().flush();
         eval_post(iter, particle);
 
         return accept_count(particle, accept_buffer_.data());
@@ -591,14 +1771,18 @@ class MoveCL
     virtual void eval_pre(std::size_t, Particle<T> &) {}
     virtual void eval_post(std::size_t, Particle<T> &) {}
 
+    /// \brief Count the number of accepted particles
+    ///
+    /// \details
+    /// The default implementation sums the accept buffer on the device once
+    /// the kernel is finished, see `StateCL::accept_count`. Reading back the
+    /// single sum is the only host synchronization of the step unless
+    /// `eval_post` waits itself.
     virtual std::size_t accept_count(
-        Particle<T> &particle, const CLMemory &accept_buffer)
+        Particle<T> &particle, const CLMemory &accept)
     {
-        particle.value().manager().read_buffer(
-            accept_buffer, particle.size(), accept_host_.data());
-
-        return static_cast<std::size_t>(std::accumulate(accept_host_.begin(),
-            accept_host_.end(), static_cast<::cl_ulong>(0)));
+        return static_cast<std::size_t>(particle.value().accept_count(
+            accept, particle.size(), kernel_event_vec_));
     }
 
     virtual void set_kernel(std::size_t iter, Particle<T> &particle)
@@ -610,17 +1794,16 @@ class MoveCL
 
     virtual void set_kernel_args(std::size_t iter, Particle<T> &particle)
     {
-        accept_host_.resize(particle.size());
         if (particle.value().manager().opencl_version() >= 120) {
-            accept_buffer_.resize(particle.size(), CL_MEM_READ_WRITE |
-                    CL_MEM_HOST_READ_ONLY | CL_MEM_USE_HOST_PTR,
-                accept_host_.data());
+            accept_buffer_.resize(
+                particle.size(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY);
         } else {
-            accept_buffer_.resize(particle.size(),
-                CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, accept_host_.data());
+            accept_buffer_.resize(particle.size(), CL_MEM_READ_WRITE);
         }
         cl_set_kernel_args(kernel_, 0, static_cast<::cl_ulong>(iter),
-            particle.value().state_buffer().data(), accept_buffer_.data());
+            particle.value().device_state_buffer(device_),
+            particle.value().device_buffer(
+                accept_buffer_, device_, accept_cache_));
     }
 
     VSMC_DEFINE_OPENCL_BACKEND_CL_CONFIGURE_KERNEL
@@ -631,9 +1814,60 @@ class MoveCL
     private:
     VSMC_DEFINE_OPENCL_BACKEND_CL_MEMBER_DATA;
     CLBuffer<::cl_ulong, typename T::cl_id> accept_buffer_;
-    std::vector<::cl_ulong> accept_host_;
+    internal::CLDeviceBufferCache accept_cache_;
+    std::vector<CLEvent> kernel_event_vec_;
 }; // class MoveCL
 
+/// \brief Sampler<T>::move_type subtype resampling on the device
+/// \ingroup OpenCL
+///
+/// \details
+/// This requires `T::weight_type` to be `WeightCL`. When the ESS falls below
+/// `threshold() * N`, the particles are resampled with
+/// `StateCL::resample` and the weights are set equal, without either the
+/// weights or the parent indices leaving the device. It is added as the last
+/// move, and the resampling threshold of the sampler is set such that it
+/// never resamples on the host. For example,
+/// ~~~{.cpp}
+/// sampler.resample_threshold(-1);
+/// sampler.move(ResampleCL<cv>(Stratified, 0.5), true);
+/// ~~~
+template <typename T>
+class ResampleCL
+{
+    public:
+    explicit ResampleCL(
+        ResampleScheme scheme = Stratified, double threshold = 0.5)
+        : scheme_(scheme), threshold_(threshold)
+    {
+    }
+
+    std::size_t operator()(std::size_t, Particle<T> &particle)
+    {
+        const double N = static_cast<double>(particle.size());
+        if (particle.weight().ess() >= threshold_ * N)
+            return 0;
+
+        particle.value().resample(
+            scheme_, particle.weight().log_weight_buffer().data());
+        particle.weight().set_equal();
+
+        return 0;
+    }
+
+    ResampleScheme scheme() const { return scheme_; }
+
+    void scheme(ResampleScheme new_scheme) { scheme_ = new_scheme; }
+
+    double threshold() const { return threshold_; }
+
+    void threshold(double new_threshold) { threshold_ = new_threshold; }
+
+    private:
+    ResampleScheme scheme_;
+    double threshold_;
+}; // class ResampleCL
+
 /// \brief Monitor<T>::eval_type subtype using OpenCL
 /// \ingroup OpenCL
 ///
@@ -644,6 +1878,18 @@ class MoveCL
 /// void kern (ulong iter, ulong dim, __global state_type *state,
 ///            __global fp_type *r);
 /// ~~~
+///
+/// If it is constructed with `record_only` being true, the Monitor shall be
+/// set to record only as well, for example,
+/// ~~~{.cpp}
+/// sampler.monitor("pos", 2, eval, true);
+/// ~~~
+/// The weighted averages of the kernel results are then computed by the
+/// evaluation itself. With WeightCL of the same `fp_type` and `cl_id`, they
+/// are computed on the device with `log_weight_buffer()`, and only `dim`
+/// values are read back per iteration, instead of the kernel results and
+/// the weights of all particles. With other weight types, they are computed
+/// on the host.
 template <typename T>
 class MonitorEvalCL
 {
@@ -666,10 +1912,17 @@ class MonitorEvalCL
 
         set_kernel_args(iter, dim, particle);
         eval_pre(iter, particle);
-        particle.value().manager().run_kernel(
-            kernel_, particle.size(), configure_.local_size());
-        particle.value().manager().template read_buffer<typename T::fp_type>(
-            buffer_.data(), particle.value().size() * dim, r);
+        CLEvent event;
+        particle.value().manager().enqueue_run_kernel(
+            kernel_, particle.size(), event, configure_.local_size());
+        if (record_only_) {
+            average(static_cast<std::size_t>(particle.size()), dim,
+                particle.weight(), event, r);
+        } else {
+            auto buffer = buffer_.map(CL_MAP_READ, {event});
+            std::copy(buffer.begin(), buffer.end(), r);
+            buffer.unmap();
+        }
         eval_post(iter, particle);
     }
 
@@ -689,10 +1942,11 @@ class MonitorEvalCL
         std::size_t iter, std::size_t dim, Particle<T> &particle)
     {
         if (particle.value().manager().opencl_version() >= 120) {
-            buffer_.resize(particle.size() * dim,
-                CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY);
+            buffer_.resize(particle.size() * dim, CL_MEM_READ_WRITE |
+                    CL_MEM_HOST_READ_ONLY | CL_MEM_ALLOC_HOST_PTR);
         } else {
-            buffer_.resize(particle.size() * dim);
+            buffer_.resize(particle.size() * dim,
+                CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
         }
         cl_set_kernel_args(kernel_, 0, static_cast<::cl_ulong>(iter),
             static_cast<::cl_ulong>(dim),
@@ -701,12 +1955,50 @@ class MonitorEvalCL
 
     VSMC_DEFINE_OPENCL_BACKEND_CL_CONFIGURE_KERNEL
 
+    /// \brief Whether the weighted averages are computed by the evaluation
+    bool record_only() const { return record_only_; }
+
     protected:
-    VSMC_DEFINE_OPENCL_BACKEND_CL_SPECIAL(MonitorEvalCL)
+    explicit MonitorEvalCL(bool record_only = false)
+        : build_id_(-1), device_(0), record_only_(record_only)
+    {
+    }
+
+    MonitorEvalCL(const MonitorEvalCL<T> &) = default;
+    MonitorEvalCL<T> &operator=(const MonitorEvalCL<T> &) = default;
+    MonitorEvalCL(MonitorEvalCL<T> &&) = default;
+    MonitorEvalCL<T> &operator=(MonitorEvalCL<T> &&) = default;
+    virtual ~MonitorEvalCL() {}
 
     private:
     VSMC_DEFINE_OPENCL_BACKEND_CL_MEMBER_DATA;
+    bool record_only_;
     CLBuffer<typename T::fp_type, typename T::cl_id> buffer_;
+    internal::CLWeightedSum<typename T::fp_type, typename T::cl_id> sum_;
+    Vector<double> weight_;
+
+    void average(std::size_t N, std::size_t dim,
+        const WeightCL<typename T::fp_type, typename T::cl_id> &weight,
+        const CLEvent &event, double *r)
+    {
+        sum_(N, dim, weight.log_weight_buffer().data(), buffer_.data(), r,
+            {event});
+    }
+
+    template <typename WeightType>
+    void average(std::size_t N, std::size_t dim, const WeightType &weight,
+        const CLEvent &event, double *r)
+    {
+        weight_.resize(N);
+        weight.read_weight(weight_.data());
+        auto buffer = buffer_.map(CL_MAP_READ, {event});
+        auto bptr = buffer.begin();
+        std::fill(r, r + dim, 0.0);
+        for (std::size_t i = 0; i != N; ++i)
+            for (std::size_t d = 0; d != dim; ++d, ++bptr)
+                r[d] += weight_[i] * static_cast<double>(*bptr);
+        buffer.unmap();
+    }
 }; // class MonitorEvalCL
 
 /// \brief Path<T>::eval_type subtype using OpenCL
@@ -740,10 +2032,12 @@ class PathEvalCL
 
         set_kernel_args(iter, particle);
         eval_pre(iter, particle);
-        particle.value().manager().run_kernel(
-            kernel_, particle.size(), configure_.local_size());
-        particle.value().manager().template read_buffer<typename T::fp_type>(
-            buffer_.data(), particle.value().size(), r);
+        CLEvent event;
+        particle.value().manager().enqueue_run_kernel(
+            kernel_, particle.size(), event, configure_.local_size());
+        auto buffer = buffer_.map(CL_MAP_READ, {event});
+        std::copy(buffer.begin(), buffer.end(), r);
+        buffer.unmap();
         eval_post(iter, particle);
 
         return this->eval_grid(iter, particle);
@@ -764,10 +2058,11 @@ class PathEvalCL
     virtual void set_kernel_args(std::size_t iter, Particle<T> &particle)
     {
         if (particle.value().manager().opencl_version() >= 120) {
-            buffer_.resize(
-                particle.size(), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY);
+            buffer_.resize(particle.size(), CL_MEM_READ_WRITE |
+                    CL_MEM_HOST_READ_ONLY | CL_MEM_ALLOC_HOST_PTR);
         } else {
-            buffer_.resize(particle.size());
+            buffer_.resize(
+                particle.size(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
         }
         cl_set_kernel_args(kernel_, 0, static_cast<::cl_ulong>(iter),
             particle.value().state_buffer().data(), buffer_.data());
@@ -34,11 +34,105 @@
 
 #include <vsmc/opencl/internal/common.hpp>
 #include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_memory_pool.hpp>
 #include <vsmc/opencl/cl_type.hpp>
 
 namespace vsmc
 {
 
+/// \brief Host view of a mapped region of an OpenCL buffer
+/// \ingroup OpenCL
+///
+/// \details
+/// The region is mapped on construction, and unmapped when the view is
+/// destroyed or unmap() is called. The view can be moved but not copied.
+/// Kernels using the buffer shall not run while the view is mapped.
+template <typename T, typename ID = CLDefault>
+class CLBufferView
+{
+    public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using pointer = T *;
+    using iterator = T *;
+    using manager_type = CLManager<ID>;
+
+    CLBufferView() : size_(0), data_(nullptr) {}
+
+    CLBufferView(const CLMemory &buffer, size_type offset, size_type N,
+        ::cl_map_flags flags, const std::vector<CLEvent> &event_wait_list =
+                                  std::vector<CLEvent>())
+        : buffer_(buffer)
+        , size_(N)
+        , data_(N == 0 ? nullptr : manager().template map_buffer<T>(buffer_,
+                                       N, flags, offset, event_wait_list))
+    {
+        if (data_ == nullptr)
+            size_ = 0;
+    }
+
+    CLBufferView(const CLBufferView<T, ID> &) = delete;
+
+    CLBufferView<T, ID> &operator=(const CLBufferView<T, ID> &) = delete;
+
+    CLBufferView(CLBufferView<T, ID> &&other)
+        : buffer_(std::move(other.buffer_))
+        , size_(other.size_)
+        , data_(other.data_)
+    {
+        other.size_ = 0;
+        other.data_ = nullptr;
+    }
+
+    CLBufferView<T, ID> &operator=(CLBufferView<T, ID> &&other)
+    {
+        if (this != &other) {
+            unmap();
+            std::swap(buffer_, other.buffer_);
+            std::swap(size_, other.size_);
+            std::swap(data_, other.data_);
+        }
+
+        return *this;
+    }
+
+    ~CLBufferView() { unmap(); }
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    /// \brief Enqueue unmapping the region
+    ///
+    /// \details
+    /// The unmapping is enqueued on the command queue of the manager, and
+    /// thus is ordered before any kernel enqueued later on the same queue
+    void unmap()
+    {
+        if (data_ == nullptr)
+            return;
+
+        manager().unmap_buffer(buffer_, data_);
+        size_ = 0;
+        data_ = nullptr;
+    }
+
+    size_type size() const { return size_; }
+
+    pointer data() const { return data_; }
+
+    iterator begin() const { return data_; }
+
+    iterator end() const { return data_ + size_; }
+
+    T &operator[](size_type i) const { return data_[i]; }
+
+    explicit operator bool() const { return data_ != nullptr; }
+
+    private:
+    CLMemory buffer_;
+    size_type size_;
+    T *data_;
+}; // class CLBufferView
+
 /// \brief OpenCL buffer
 /// \ingroup OpenCL
 ///
@@ -60,8 +154,7 @@ class CLBuffer
         : size_(N)
         , flag_(flag)
         , host_ptr_(host_ptr)
-        , data_(manager().template create_buffer<value_type>(
-              size_, flag_, host_ptr_))
+        , data_(allocate(size_, flag_, host_ptr_))
     {
     }
 
@@ -69,8 +162,7 @@ class CLBuffer
         : size_(other.size_)
         , flag_(other.flag_)
         , host_ptr_(other.host_ptr_)
-        , data_(manager().template create_buffer<value_type>(
-              size_, flag_, host_ptr_))
+        , data_(allocate(size_, flag_, host_ptr_))
     {
         if (size_ != 0 && (flag_ & CL_MEM_HOST_WRITE_ONLY) != 0 &&
             (flag_ & CL_MEM_HOST_READ_ONLY) != 0) {
@@ -116,10 +208,12 @@ class CLBuffer
         return *this;
     }
 
-    ~CLBuffer() {}
+    ~CLBuffer() { deallocate(); }
 
     static manager_type &manager() { return manager_type::instance(); }
 
+    static CLMemoryPool<ID> &pool() { return CLMemoryPool<ID>::instance(); }
+
     size_type size() const { return size_; }
 
     ::cl_mem_flags flag() const { return flag_; }
@@ -134,14 +228,37 @@ class CLBuffer
     /// direct access to the raw buffer.
     const CLMemory &data() const { return data_; }
 
+    /// \brief Map `N` elements starting at `offset` into the host address
+    /// space
+    ///
+    /// \details
+    /// For buffers created with `CL_MEM_ALLOC_HOST_PTR` or
+    /// `CL_MEM_USE_HOST_PTR`, or on devices sharing memory with the host, no
+    /// copy is made
+    CLBufferView<T, ID> map(size_type offset, size_type N,
+        ::cl_map_flags flags = CL_MAP_READ,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        return CLBufferView<T, ID>(data_, offset, N, flags, event_wait_list);
+    }
+
+    /// \brief Map the whole buffer into the host address space
+    CLBufferView<T, ID> map(::cl_map_flags flags = CL_MAP_READ,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        return CLBufferView<T, ID>(data_, 0, size_, flags, event_wait_list);
+    }
+
     void resize(size_type N)
     {
         if (N == size_)
             return;
 
+        deallocate();
         size_ = N;
-        data_ = manager().template create_buffer<value_type>(
-            size_, flag_, host_ptr_);
+        data_ = allocate(size_, flag_, host_ptr_);
     }
 
     void resize(size_type N, ::cl_mem_flags flag)
@@ -149,10 +266,10 @@ class CLBuffer
         if (N == size_ && flag == flag_)
             return;
 
+        deallocate();
         size_ = N;
         flag_ = flag;
-        data_ = manager().template create_buffer<value_type>(
-            size_, flag_, host_ptr_);
+        data_ = allocate(size_, flag_, host_ptr_);
     }
 
     void resize(size_type N, ::cl_mem_flags flag, void *host_ptr)
@@ -160,11 +277,11 @@ class CLBuffer
         if (N == size_ && flag == flag_ && host_ptr == host_ptr_)
             return;
 
+        deallocate();
         size_ = N;
         flag_ = flag;
         host_ptr_ = host_ptr;
-        data_ = manager().template create_buffer<value_type>(
-            size_, flag_, host_ptr_);
+        data_ = allocate(size_, flag_, host_ptr_);
     }
 
     private:
@@ -172,6 +289,28 @@ class CLBuffer
     ::cl_mem_flags flag_;
     void *host_ptr_;
     CLMemory data_;
+
+    static bool pooled(const void *host_ptr)
+    {
+        return VSMC_OPENCL_USE_MEMORY_POOL && host_ptr == nullptr;
+    }
+
+    static CLMemory allocate(
+        size_type N, ::cl_mem_flags flag, void *host_ptr)
+    {
+        if (pooled(host_ptr))
+            return pool().acquire(sizeof(value_type) * N, flag);
+
+        return manager().template create_buffer<value_type>(
+            N, flag, host_ptr);
+    }
+
+    void deallocate()
+    {
+        if (pooled(host_ptr_))
+            pool().release(std::move(data_), flag_);
+        data_ = CLMemory(nullptr);
+    }
 }; // class CLBuffer
 
 } // namespace vsmc
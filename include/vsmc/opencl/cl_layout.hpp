@@ -0,0 +1,154 @@
+//============================================================================
+// vSMC/include/vsmc/opencl/cl_layout.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_OPENCL_CL_LAYOUT_HPP
+#define VSMC_OPENCL_CL_LAYOUT_HPP
+
+#include <vsmc/opencl/internal/common.hpp>
+
+#define VSMC_STATIC_ASSERT_OPENCL_CL_LAYOUT_TILE(Tile)                        \
+    VSMC_STATIC_ASSERT(                                                       \
+        (Tile > 0), "**CLLayoutAoSoA** USED WITH Tile EQUAL TO ZERO")
+
+namespace vsmc
+{
+
+/// \brief Array of structures layout of StateCL (default)
+/// \ingroup OpenCL
+///
+/// \details
+/// The state of particle `i` occupies the `StateSize` bytes starting at
+/// `state + i * StateSize`, and kernels can access it as `state[i]` with a
+/// suitable `state_type`.
+class CLLayoutAoS
+{
+    public:
+    /// \brief Whether the components of different particles are interleaved
+    static constexpr bool interleaved() { return false; }
+
+    /// \brief The number of particles the buffer is allocated for
+    static std::size_t padded_size(std::size_t N) { return N; }
+
+    /// \brief The offset of component `k` of particle `i`, in units of
+    /// components, where `n` is `padded_size(N)` and `d` is the number of
+    /// components of a particle
+    static std::size_t offset(
+        std::size_t i, std::size_t k, std::size_t, std::size_t d)
+    {
+        return i * d + k;
+    }
+
+    /// \brief Define the macro `name(i, k, n, d)` computing `offset` in
+    /// OpenCL C, and a macro identifying the layout
+    static void define(std::stringstream &ss, const std::string &name)
+    {
+        ss << "#ifndef STATE_LAYOUT_AOS\n";
+        ss << "#define STATE_LAYOUT_AOS 1\n";
+        ss << "#endif\n";
+        ss << "#define " << name << "(i, k, n, d) ((i) * (d) + (k))\n";
+    }
+}; // class CLLayoutAoS
+
+/// \brief Structure of arrays layout of StateCL
+/// \ingroup OpenCL
+///
+/// \details
+/// The state is viewed as `StateSize / sizeof(fp_type)` components of type
+/// `fp_type`, and component `k` of all particles are stored contiguously.
+/// Adjacent work-items accessing the same component thus access adjacent
+/// addresses.
+class CLLayoutSoA
+{
+    public:
+    static constexpr bool interleaved() { return true; }
+
+    static std::size_t padded_size(std::size_t N) { return N; }
+
+    static std::size_t offset(
+        std::size_t i, std::size_t k, std::size_t n, std::size_t)
+    {
+        return k * n + i;
+    }
+
+    static void define(std::stringstream &ss, const std::string &name)
+    {
+        ss << "#ifndef STATE_LAYOUT_SOA\n";
+        ss << "#define STATE_LAYOUT_SOA 1\n";
+        ss << "#endif\n";
+        ss << "#define " << name << "(i, k, n, d) ((k) * (n) + (i))\n";
+    }
+}; // class CLLayoutSoA
+
+/// \brief Array of structures of arrays layout of StateCL
+/// \ingroup OpenCL
+///
+/// \details
+/// Particles are grouped into tiles of `Tile` particles, and within each
+/// tile the components are stored as by CLLayoutSoA. The buffer is allocated
+/// for a multiple of `Tile` particles. A tile of a few times the SIMD width
+/// of the device keeps the accesses of a work-group contiguous, while the
+/// components of a particle stay close to each other.
+template <std::size_t Tile>
+class CLLayoutAoSoA
+{
+    VSMC_STATIC_ASSERT_OPENCL_CL_LAYOUT_TILE(Tile);
+
+    public:
+    static constexpr bool interleaved() { return true; }
+
+    static std::size_t padded_size(std::size_t N)
+    {
+        return (N + Tile - 1) / Tile * Tile;
+    }
+
+    static std::size_t offset(
+        std::size_t i, std::size_t k, std::size_t, std::size_t d)
+    {
+        return (i / Tile) * Tile * d + k * Tile + i % Tile;
+    }
+
+    static void define(std::stringstream &ss, const std::string &name)
+    {
+        ss << "#ifndef STATE_LAYOUT_AOSOA\n";
+        ss << "#define STATE_LAYOUT_AOSOA 1\n";
+        ss << "#endif\n";
+        ss << "#ifndef STATE_TILE\n";
+        ss << "#define STATE_TILE " << Tile << "UL\n";
+        ss << "#endif\n";
+        ss << "#define " << name << "(i, k, n, d) (((i) / " << Tile
+           << "UL) * " << Tile << "UL * (d) + (k) * " << Tile << "UL + (i) % "
+           << Tile << "UL)\n";
+    }
+}; // class CLLayoutAoSoA
+
+} // namespace vsmc
+
+#endif // VSMC_OPENCL_CL_LAYOUT_HPP
@@ -164,6 +164,32 @@ class CLManager
     /// \brief The command queue currently being used
     const CLCommandQueue &command_queue() const { return command_queue_; }
 
+    /// \brief The command queue of the `i`th device of `device_vec()`
+    ///
+    /// \details
+    /// The queue of `device()` is `command_queue()`, and each other device in
+    /// the context has its own in-order queue, such that kernels on different
+    /// devices may run concurrently.
+    const CLCommandQueue &command_queue(std::size_t i) const
+    {
+        return command_queue_vec_[i];
+    }
+
+    /// \brief The command queues of all devices, see `command_queue(i)`
+    const std::vector<CLCommandQueue> &command_queue_vec() const
+    {
+        return command_queue_vec_;
+    }
+
+    /// \brief The command queue used for non-blocking host/device transfers
+    ///
+    /// \details
+    /// This is a second in-order queue on the same device, such that
+    /// transfers enqueued on it may overlap with kernels running on
+    /// command_queue(). If it cannot be created, or the queues were set
+    /// manually with a single queue, it is the same as command_queue().
+    const CLCommandQueue &transfer_queue() const { return transfer_queue_; }
+
     /// \brief Whether the platform, context, device and command queue has
     /// been
     /// setup correctly
@@ -179,6 +205,31 @@ class CLManager
         return setup_;
     }
 
+    /// \brief Try to setup the platform, context, device and command queue
+    /// using the given device type, such that each of the `size` processes
+    /// sharing a node uses a distinct device
+    ///
+    /// \details
+    /// The process with node-local rank `rank` uses the `rank % n`th of the
+    /// `n` devices selected as usual. A device of type CPU shared by more
+    /// than one process is partitioned, by NUMA domains if their number
+    /// equals the number of processes sharing it, or otherwise into
+    /// sub-devices with equal numbers of compute units. Each process then
+    /// uses a distinct sub-device. If the device cannot be partitioned, the
+    /// processes share it. For example, with MPIEnvironment,
+    /// ~~~{.cpp}
+    /// vsmc::MPIEnvironment env(argc, argv);
+    /// vsmc::CLManager<>::instance().setup(
+    ///     CL_DEVICE_TYPE_GPU, env.node_rank(), env.node_size());
+    /// ~~~
+    bool setup(::cl_device_type dev, std::size_t rank, std::size_t size)
+    {
+        setup_ = false;
+        setup_cl_manager(dev, rank, size);
+
+        return setup_;
+    }
+
     /// \brief Set the platform, context, device and command queue manually
     ///
     /// \details
@@ -186,6 +237,15 @@ class CLManager
     /// calls
     bool setup(const CLPlatform &plat, const CLContext &ctx,
         const CLDevice &dev, const CLCommandQueue &cmd)
+    {
+        return setup(plat, ctx, dev, cmd, cmd);
+    }
+
+    /// \brief Set the platform, context, device, command queue and transfer
+    /// queue manually
+    bool setup(const CLPlatform &plat, const CLContext &ctx,
+        const CLDevice &dev, const CLCommandQueue &cmd,
+        const CLCommandQueue &transfer)
     {
         setup_ = false;
         platform_ = plat;
@@ -193,6 +253,9 @@ class CLManager
         device_ = dev;
         device_vec_ = context_.get_device();
         command_queue_ = cmd;
+        transfer_queue_ = transfer;
+        if (!setup_command_queue_vec())
+            return setup_;
         check_opencl_version();
 
         setup_ = true;
@@ -214,8 +277,56 @@ class CLManager
         return CLMemory(context_, flags, sizeof(CLType) * num, host_ptr);
     }
 
+    /// \brief Map a region of an OpenCL buffer of a given type and number of
+    /// elements into the host address space
+    ///
+    /// \details
+    /// The mapping is blocking. On devices sharing memory with the host, and
+    /// for buffers created with `CL_MEM_ALLOC_HOST_PTR` or
+    /// `CL_MEM_USE_HOST_PTR`, no copy is made. The returned pointer shall be
+    /// released by unmap_buffer() before the buffer is used by kernels. It is
+    /// `nullptr` if the mapping failed. See also CLBuffer::map().
+    template <typename CLType>
+    CLType *map_buffer(const CLMemory &buf, std::size_t num,
+        ::cl_map_flags flags, std::size_t offset = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(map_buffer);
+
+        CLEvent event;
+
+        return static_cast<CLType *>(command_queue_.enqueue_map_buffer(buf,
+            CL_TRUE, flags, sizeof(CLType) * offset, sizeof(CLType) * num,
+            event_wait_list, event));
+    }
+
+    /// \brief Enqueue unmapping a pointer returned by map_buffer()
+    ::cl_int unmap_buffer(const CLMemory &buf, void *ptr, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(unmap_buffer);
+
+        return command_queue_.enqueue_unmap_mem_object(
+            buf, ptr, event_wait_list, event);
+    }
+
+    /// \brief Enqueue unmapping a pointer returned by map_buffer()
+    ::cl_int unmap_buffer(const CLMemory &buf, void *ptr) const
+    {
+        CLEvent event;
+
+        return unmap_buffer(buf, ptr, event);
+    }
+
     /// \brief Read an OpenCL buffer of a given type and number of elements
     /// into an iterator
+    ///
+    /// \details
+    /// The buffer is mapped and copied into the iterator directly, without a
+    /// temporary vector. If the host access flags of the buffer forbid
+    /// mapping it for reading, it is read into a temporary vector instead
     template <typename CLType, typename OutputIter>
     ::cl_int read_buffer(const CLMemory &buf, std::size_t num,
         OutputIter first, std::size_t offset = 0,
@@ -224,15 +335,28 @@ class CLManager
     {
         VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(read_buffer);
 
-        CLEvent event;
-        std::vector<CLType> buffer(num);
-        ::cl_int status = command_queue_.enqueue_read_buffer(buf, CL_TRUE,
-            sizeof(CLType) * offset, sizeof(CLType) * num, buffer.data(),
-            event_wait_list, event);
-        if (status == CL_SUCCESS)
-            std::copy(buffer.begin(), buffer.end(), first);
+        if (num == 0)
+            return CL_SUCCESS;
 
-        return status;
+#if VSMC_OPENCL_VERSION >= 120
+        if (!map_allowed(
+                buf, CL_MEM_HOST_WRITE_ONLY | CL_MEM_HOST_NO_ACCESS)) {
+            std::vector<CLType> tmp(num);
+            ::cl_int status =
+                read_buffer(buf, num, tmp.data(), offset, event_wait_list);
+            std::copy(tmp.begin(), tmp.end(), first);
+
+            return status;
+        }
+#endif
+
+        CLType *ptr = map_buffer<CLType>(
+            buf, num, CL_MAP_READ, offset, event_wait_list);
+        if (ptr == nullptr)
+            return CL_MAP_FAILURE;
+        std::copy_n(ptr, num, first);
+
+        return unmap_buffer(buf, ptr);
     }
 
     /// \brief Read an OpenCL buffer of a given type and number of elements
@@ -253,6 +377,11 @@ class CLManager
 
     /// \brief Write an OpenCL buffer of a given type and number of elements
     /// from an iterator
+    ///
+    /// \details
+    /// The buffer is mapped and copied from the iterator directly, without a
+    /// temporary vector. If the host access flags of the buffer forbid
+    /// mapping it for writing, it is written from a temporary vector instead
     template <typename CLType, typename InputIter>
     ::cl_int write_buffer(const CLMemory &buf, std::size_t num,
         InputIter first, std::size_t offset = 0,
@@ -261,13 +390,36 @@ class CLManager
     {
         VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(write_buffer);
 
+        if (num == 0)
+            return CL_SUCCESS;
+
+#if VSMC_OPENCL_VERSION >= 120
+        if (!map_allowed(
+                buf, CL_MEM_HOST_READ_ONLY | CL_MEM_HOST_NO_ACCESS)) {
+            std::vector<CLType> tmp(num);
+            std::copy_n(first, num, tmp.begin());
+
+            return write_buffer(
+                buf, num, tmp.data(), offset, event_wait_list);
+        }
+        ::cl_map_flags flags = opencl_version_ >= 120 ?
+            CL_MAP_WRITE_INVALIDATE_REGION :
+            CL_MAP_WRITE;
+#else
+        ::cl_map_flags flags = CL_MAP_WRITE;
+#endif
+        CLType *ptr =
+            map_buffer<CLType>(buf, num, flags, offset, event_wait_list);
+        if (ptr == nullptr)
+            return CL_MAP_FAILURE;
+        std::copy_n(first, num, ptr);
+
         CLEvent event;
-        std::vector<CLType> buffer(num);
-        std::copy_n(first, num, buffer.data());
+        ::cl_int status = unmap_buffer(buf, ptr, event);
+        if (status == CL_SUCCESS)
+            return event.wait();
 
-        return command_queue_.enqueue_write_buffer(buf, CL_TRUE,
-            sizeof(CLType) * offset, sizeof(CLType) * num, buffer.data(),
-            event_wait_list, event);
+        return status;
     }
 
     /// \brief Write an OpenCL buffer of a given type and number of elements
@@ -316,9 +468,8 @@ class CLManager
         VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(copy_buffer);
 
         CLEvent event;
-        ::cl_int status = command_queue_.enqueue_copy_buffer(src, dst,
-            sizeof(CLType) * src_offset, sizeof(CLType) * dst_offset,
-            sizeof(CLType) * num, event_wait_list, event);
+        ::cl_int status = enqueue_copy_buffer<CLType>(
+            src, dst, num, event, src_offset, dst_offset, event_wait_list);
         if (status == CL_SUCCESS)
             return event.wait();
 
@@ -350,6 +501,88 @@ class CLManager
     {
         VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(run_kernel);
 
+        CLEvent event;
+        ::cl_int status =
+            enqueue_run_kernel(kern, N, event, local_size, event_wait_list);
+        if (status == CL_SUCCESS)
+            return event.wait();
+
+        return status;
+    }
+
+    /// \brief Enqueue reading an OpenCL buffer of a given type and number of
+    /// elements into a pointer without waiting for it to finish
+    ///
+    /// \details
+    /// The memory pointed by `first` shall remain valid, and its content is
+    /// not available, until `event` is completed.
+    ///
+    /// The read is enqueued on transfer_queue(), which is not ordered with
+    /// the kernels on command_queue(). Events of the commands that produce
+    /// the buffer shall be in `event_wait_list`.
+    template <typename CLType>
+    ::cl_int enqueue_read_buffer(const CLMemory &buf, std::size_t num,
+        CLType *first, CLEvent &event, std::size_t offset = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_read_buffer);
+
+        return transfer_queue_.enqueue_read_buffer(buf, CL_FALSE,
+            sizeof(CLType) * offset, sizeof(CLType) * num, first,
+            event_wait_list, event);
+    }
+
+    /// \brief Enqueue writing an OpenCL buffer of a given type and number of
+    /// elements from a pointer without waiting for it to finish
+    ///
+    /// \details
+    /// The memory pointed by `first` shall remain valid and unchanged until
+    /// `event` is completed.
+    ///
+    /// The write is enqueued on transfer_queue(). Events of the commands that
+    /// still use the buffer shall be in `event_wait_list`, and commands on
+    /// command_queue() that use the new content shall wait on `event`.
+    template <typename CLType>
+    ::cl_int enqueue_write_buffer(const CLMemory &buf, std::size_t num,
+        const CLType *first, CLEvent &event, std::size_t offset = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_write_buffer);
+
+        return transfer_queue_.enqueue_write_buffer(buf, CL_FALSE,
+            sizeof(CLType) * offset, sizeof(CLType) * num,
+            const_cast<CLType *>(first), event_wait_list, event);
+    }
+
+    /// \brief Enqueue copying an OpenCL buffer into another of a given type
+    /// and number of elements without waiting for it to finish
+    template <typename CLType>
+    ::cl_int enqueue_copy_buffer(const CLMemory &src, const CLMemory &dst,
+        std::size_t num, CLEvent &event, std::size_t src_offset = 0,
+        std::size_t dst_offset = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_copy_buffer);
+
+        return command_queue_.enqueue_copy_buffer(src, dst,
+            sizeof(CLType) * src_offset, sizeof(CLType) * dst_offset,
+            sizeof(CLType) * num, event_wait_list, event);
+    }
+
+    /// \brief Enqueue a given kernel without waiting for it to finish
+    ///
+    /// \details
+    /// See `run_kernel` for the global and local sizes
+    ::cl_int enqueue_run_kernel(const CLKernel &kern, std::size_t N,
+        CLEvent &event, std::size_t local_size = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_run_kernel);
+
         std::size_t gsize = 0;
         std::size_t lsize = local_size;
         if (local_size == 0)
@@ -357,12 +590,103 @@ class CLManager
         else
             gsize = cl_min_global_size(N, local_size);
 
-        CLEvent event;
-        ::cl_int status =
-            command_queue_.enqueue_nd_range_kernel(kern, 1, CLNDRange(),
-                CLNDRange(gsize), CLNDRange(lsize), event_wait_list, event);
-        if (status == CL_SUCCESS)
-            return event.wait();
+        return command_queue_.enqueue_nd_range_kernel(kern, 1, CLNDRange(),
+            CLNDRange(gsize), CLNDRange(lsize), event_wait_list, event);
+    }
+
+    /// \brief Enqueue a given kernel on the `i`th device of `device_vec()`
+    /// without waiting for it to finish
+    ::cl_int enqueue_run_kernel(std::size_t i, const CLKernel &kern,
+        std::size_t N, CLEvent &event, std::size_t local_size = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_run_kernel);
+
+        std::size_t gsize = 0;
+        std::size_t lsize = local_size;
+        if (local_size == 0)
+            cl_preferred_work_size(N, kern, device_vec_[i], gsize, lsize);
+        else
+            gsize = cl_min_global_size(N, local_size);
+
+        return command_queue_vec_[i].enqueue_nd_range_kernel(kern, 1,
+            CLNDRange(), CLNDRange(gsize), CLNDRange(lsize), event_wait_list,
+            event);
+    }
+
+    /// \brief Migrate memory objects to the `i`th device of `device_vec()`
+    ///
+    /// \details
+    /// The migration is enqueued on the queue of that device, and thus
+    /// commands enqueued on it later find the objects resident
+    ::cl_int enqueue_migrate_buffer(std::size_t i,
+        const std::vector<CLMemory> &mem_objects, CLEvent &event,
+        ::cl_mem_migration_flags flags = 0,
+        const std::vector<CLEvent> &event_wait_list =
+            std::vector<CLEvent>()) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_migrate_buffer);
+
+        return command_queue_vec_[i].enqueue_migrate_mem_objects(
+            mem_objects, flags, event_wait_list, event);
+    }
+
+    /// \brief Make commands enqueued later on `command_queue()` wait for the
+    /// events, which may be from other queues
+    ::cl_int enqueue_barrier(const std::vector<CLEvent> &event_wait_list,
+        CLEvent &event) const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(enqueue_barrier);
+
+        return command_queue_.enqueue_barrier_with_wait_list(
+            event_wait_list, event);
+    }
+
+    /// \brief Submit all enqueued commands to the devices
+    ///
+    /// \details
+    /// Commands enqueued without waiting may not start until the queue is
+    /// flushed or waited. Calling this after a batch of commands lets the
+    /// devices work while the host continues. It is also required before
+    /// waiting on an event whose command waits on another queue.
+    ::cl_int flush() const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(flush);
+
+        ::cl_int status = CL_SUCCESS;
+        for (const auto &queue : command_queue_vec_) {
+            status = queue.flush();
+            if (status != CL_SUCCESS)
+                return status;
+        }
+        if (!separate_queue())
+            return status;
+
+        return transfer_queue_.flush();
+    }
+
+    /// \brief Wait for all enqueued commands on all queues to finish
+    ///
+    /// \details
+    /// This is the synchronization point of an iteration
+    ::cl_int finish() const
+    {
+        VSMC_RUNTIME_ASSERT_OPENCL_CL_MANAGER_SETUP(finish);
+
+        ::cl_int status = flush();
+        if (status != CL_SUCCESS)
+            return status;
+        if (separate_queue()) {
+            status = transfer_queue_.finish();
+            if (status != CL_SUCCESS)
+                return status;
+        }
+        for (const auto &queue : command_queue_vec_) {
+            status = queue.finish();
+            if (status != CL_SUCCESS)
+                return status;
+        }
 
         return status;
     }
@@ -381,11 +705,25 @@ class CLManager
     }
 
     private:
+#if VSMC_OPENCL_VERSION >= 120
+    // Whether a buffer can be mapped, that is, none of the host access flags
+    // in `forbid` is set
+    static bool map_allowed(const CLMemory &buf, ::cl_mem_flags forbid)
+    {
+        ::cl_mem_flags flags = 0;
+        buf.get_info(CL_MEM_FLAGS, flags);
+
+        return (flags & forbid) == 0;
+    }
+#endif
+
     CLPlatform platform_;
     CLContext context_;
     CLDevice device_;
     CLCommandQueue command_queue_;
+    CLCommandQueue transfer_queue_;
     std::vector<CLDevice> device_vec_;
+    std::vector<CLCommandQueue> command_queue_vec_;
 
     bool setup_;
     CLSetup<ID> &setup_default_;
@@ -411,7 +749,8 @@ class CLManager
         }
     }
 
-    void setup_cl_manager(::cl_device_type dev_type)
+    void setup_cl_manager(::cl_device_type dev_type, std::size_t rank = 0,
+        std::size_t size = 1)
     {
         setup_ = false;
 
@@ -427,6 +766,8 @@ class CLManager
             VSMC_RUNTIME_WARNING_OPENCL_CL_MANAGER_SETUP_DEVICE;
             return;
         }
+        if (size > 1)
+            dev_select = device_bind(dev_select, rank, size);
 
         ::cl_context_properties properties[] = {CL_CONTEXT_PLATFORM,
             reinterpret_cast<::cl_context_properties>(platform_.get()), 0};
@@ -448,12 +789,40 @@ class CLManager
             VSMC_RUNTIME_WARNING_OPENCL_CL_MANAGER_SETUP_COMMAND_QUEUE;
             return;
         }
+        transfer_queue_ = CLCommandQueue(context_, device_, 0);
+        if (!bool(transfer_queue_))
+            transfer_queue_ = command_queue_;
+        if (!setup_command_queue_vec())
+            return;
 
         check_opencl_version();
 
         setup_ = true;
     }
 
+    bool setup_command_queue_vec()
+    {
+        command_queue_vec_.clear();
+        for (const auto &dev : device_vec_) {
+            if (dev.get() == device_.get()) {
+                command_queue_vec_.push_back(command_queue_);
+                continue;
+            }
+            command_queue_vec_.push_back(CLCommandQueue(context_, dev, 0));
+            if (!bool(command_queue_vec_.back())) {
+                VSMC_RUNTIME_WARNING_OPENCL_CL_MANAGER_SETUP_COMMAND_QUEUE;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool separate_queue() const
+    {
+        return transfer_queue_.get() != command_queue_.get();
+    }
+
     bool platform_filter(::cl_device_type dev_type)
     {
         std::vector<CLPlatform> plat_vec(CLPlatform::platforms());
@@ -540,6 +909,74 @@ class CLManager
 
         return dev_select;
     }
+
+    std::vector<CLDevice> device_bind(const std::vector<CLDevice> &dev_select,
+        std::size_t rank, std::size_t size)
+    {
+        const std::size_t n = dev_select.size();
+        const std::size_t k = rank % n;
+        const CLDevice &dev = dev_select[k];
+
+        // The number of processes sharing the device and the index of this
+        // process among them
+        const std::size_t share = (size - k + n - 1) / n;
+        const std::size_t index = rank / n;
+
+        ::cl_device_type type;
+        dev.get_info(CL_DEVICE_TYPE, type);
+        if (share < 2 || (type & CL_DEVICE_TYPE_CPU) == 0)
+            return std::vector<CLDevice>(1, dev);
+
+        std::vector<CLDevice> sub(device_partition(dev, share));
+        if (sub.size() == 0)
+            return std::vector<CLDevice>(1, dev);
+
+        return std::vector<CLDevice>(1, sub[index * sub.size() / share]);
+    }
+
+    std::vector<CLDevice> device_partition(
+        const CLDevice &dev, std::size_t share)
+    {
+        std::vector<::cl_device_partition_property> prop;
+        dev.get_info(CL_DEVICE_PARTITION_PROPERTIES, prop);
+        bool equally = false;
+        bool affinity = false;
+        for (auto p : prop) {
+            if (p == CL_DEVICE_PARTITION_EQUALLY)
+                equally = true;
+            if (p == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN)
+                affinity = true;
+        }
+
+        if (affinity) {
+            ::cl_device_affinity_domain domain = 0;
+            dev.get_info(CL_DEVICE_PARTITION_AFFINITY_DOMAIN, domain);
+            if ((domain & CL_DEVICE_AFFINITY_DOMAIN_NUMA) != 0) {
+                ::cl_device_partition_property numa[] = {
+                    CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                    CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+                std::vector<CLDevice> sub(dev.sub_devices(numa));
+                if (sub.size() == share)
+                    return sub;
+            }
+        }
+
+        if (equally) {
+            ::cl_uint cu = 0;
+            ::cl_uint max_sub = 0;
+            dev.get_info(CL_DEVICE_MAX_COMPUTE_UNITS, cu);
+            dev.get_info(CL_DEVICE_PARTITION_MAX_SUB_DEVICES, max_sub);
+            if (cu >= share && max_sub >= share) {
+                ::cl_device_partition_property equal[] = {
+                    CL_DEVICE_PARTITION_EQUALLY,
+                    static_cast<::cl_device_partition_property>(cu / share),
+                    0};
+                return dev.sub_devices(equal);
+            }
+        }
+
+        return std::vector<CLDevice>();
+    }
 }; // clss CLManager
 
 } // namespace vsmc
@@ -144,6 +144,35 @@ inline void cl_set_kernel_args(const CLKernel &kern, ::cl_uint offset,
     cl_set_kernel_args(kern, offset + 1, args...);
 }
 
+/// \brief Create a sub-buffer of `size` bytes starting at byte `origin`
+/// \ingroup OpenCL
+///
+/// \details
+/// If `mem` is itself a sub-buffer, such as one obtained from CLMemoryPool,
+/// the sub-buffer is created from its parent with the origin adjusted, since
+/// OpenCL does not allow sub-buffers of sub-buffers. The origin, with that
+/// of `mem` added, shall be a multiple of `CL_DEVICE_MEM_BASE_ADDR_ALIGN` of
+/// the devices using it. With `flags` equal to zero, the access flags of the
+/// parent are inherited.
+inline CLMemory cl_sub_buffer(const CLMemory &mem, std::size_t origin,
+    std::size_t size, ::cl_mem_flags flags = 0)
+{
+    CLMemory base(mem);
+    ::cl_mem parent = nullptr;
+    mem.get_info(CL_MEM_ASSOCIATED_MEMOBJECT, parent);
+    if (parent != nullptr) {
+        std::size_t offset = 0;
+        mem.get_info(CL_MEM_OFFSET, offset);
+        origin += offset;
+        ::clRetainMemObject(parent);
+        base = CLMemory(parent);
+    }
+
+    ::cl_buffer_region region = {origin, size};
+
+    return base.sub_buffer(flags, CL_BUFFER_CREATE_TYPE_REGION, &region);
+}
+
 } // namespace vsmc
 
 #endif // VSMC_OPENCL_CL_MANIP_HPP
@@ -0,0 +1,320 @@
+//============================================================================
+// vSMC/include/vsmc/opencl/cl_memory_pool.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_OPENCL_CL_MEMORY_POOL_HPP
+#define VSMC_OPENCL_CL_MEMORY_POOL_HPP
+
+#include <vsmc/opencl/internal/common.hpp>
+#include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_type.hpp>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+/// \brief Default slab size in bytes of CLMemoryPool
+/// \ingroup Config
+#ifndef VSMC_OPENCL_MEMORY_POOL_SLAB
+#define VSMC_OPENCL_MEMORY_POOL_SLAB (1U << 24)
+#endif
+
+/// \brief Whether CLBuffer allocates from CLMemoryPool
+/// \ingroup Config
+#ifndef VSMC_OPENCL_USE_MEMORY_POOL
+#define VSMC_OPENCL_USE_MEMORY_POOL 1
+#endif
+
+namespace vsmc
+{
+
+/// \brief Pool of OpenCL buffers recycled by size class
+/// \ingroup OpenCL
+///
+/// \details
+/// Each instance is a singleton for the CLManager with the same `ID`.
+/// Requests of at most half the slab size are rounded up to size classes,
+/// four per power of two, each a multiple of the base address alignment of
+/// the devices, such that no more than a quarter of a block is wasted. They
+/// are served by sub-buffers carved on demand from slabs. All size classes
+/// with the same flags share one slab at a time, and a new slab is created
+/// only when the current one is used up. Larger requests are served by
+/// dedicated buffers. Released buffers are kept in free lists keyed by flags
+/// and size, and handed out again for requests of the same class, such that
+/// resizing buffers in the sampling loop no longer creates and releases
+/// OpenCL memory objects. Memory is returned to the driver only by clear(),
+/// or when the context of the manager changes.
+///
+/// When a buffer is released, a marker is enqueued on each command queue of
+/// the manager, and the buffer is not handed out again before all of them
+/// complete, such that commands still pending on any queue, including
+/// CLManager::transfer_queue() and the queues of other devices, never see
+/// the buffer reused. A free buffer whose markers have completed is
+/// preferred. If there is none, acquire() waits for the oldest one instead
+/// of growing the pool. With OpenCL 1.1, the manager is finished instead.
+///
+/// Buffers created with a host pointer cannot be pooled. CLBuffer uses the
+/// pool for all other buffers unless `VSMC_OPENCL_USE_MEMORY_POOL` is zero.
+template <typename ID = CLDefault>
+class CLMemoryPool
+{
+    public:
+    using size_type = std::size_t;
+    using manager_type = CLManager<ID>;
+
+    CLMemoryPool(const CLMemoryPool<ID> &) = delete;
+
+    CLMemoryPool<ID> &operator=(const CLMemoryPool<ID> &) = delete;
+
+    static CLMemoryPool<ID> &instance()
+    {
+        static CLMemoryPool<ID> pool;
+
+        return pool;
+    }
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    /// \brief Size in bytes of slabs created for small requests
+    size_type slab_size() const { return slab_size_; }
+
+    /// \brief Set the slab size, which only affects slabs created later
+    void slab_size(size_type bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slab_size_ = bytes;
+    }
+
+    /// \brief The number of bytes that will be actually allocated for a
+    /// request of `bytes`
+    size_type bin(size_type bytes) const
+    {
+        if (bytes * 2 > slab_size_)
+            return bytes;
+
+        size_type b = align_;
+        while (b * 2 < bytes)
+            b <<= 1;
+        if (bytes <= b)
+            return b;
+
+        const size_type step = std::max(b / 4, align_);
+
+        return (bytes + step - 1) / step * step;
+    }
+
+    /// \brief Total bytes of memory held by the pool, either in use or free
+    size_type bytes() const { return bytes_; }
+
+    /// \brief Get a buffer of at least `bytes` bytes with the given flags
+    CLMemory acquire(size_type bytes, ::cl_mem_flags flags)
+    {
+        if (bytes == 0)
+            return CLMemory(nullptr);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        check_context();
+        const size_type b = bin(bytes);
+        std::vector<block_type> &free = free_[key_type(flags, b)];
+        if (free.empty())
+            return grow(b, flags);
+
+        auto iter = free.begin();
+        while (iter != free.end() && !complete(iter->pending))
+            ++iter;
+        if (iter == free.end()) {
+            iter = free.begin();
+            CLEvent::wait(iter->pending);
+        }
+        CLMemory mem(std::move(iter->mem));
+        free.erase(iter);
+
+        return mem;
+    }
+
+    /// \brief Return a buffer obtained by acquire() with the same `flags`
+    void release(CLMemory &&mem, ::cl_mem_flags flags)
+    {
+        if (!bool(mem))
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ::cl_context ctx = nullptr;
+        mem.get_info(CL_MEM_CONTEXT, ctx);
+        if (ctx != context_.get())
+            return;
+        block_type block;
+        mem.get_info(CL_MEM_SIZE, block.size);
+        block.mem = std::move(mem);
+        fence(block.pending);
+        free_[key_type(flags, block.size)].push_back(std::move(block));
+    }
+
+    /// \brief Release all free buffers and slabs to the driver
+    ///
+    /// \details
+    /// Buffers still in use keep their slabs alive until they are released
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.clear();
+        slab_.clear();
+        bytes_ = 0;
+    }
+
+    private:
+    using key_type = std::pair<::cl_mem_flags, size_type>;
+
+    struct block_type {
+        CLMemory mem;
+        size_type size;
+        std::vector<CLEvent> pending;
+
+        block_type() : size(0) {}
+    }; // struct block_type
+
+    struct slab_type {
+        CLMemory mem;
+        size_type size;
+        size_type used;
+
+        slab_type() : size(0), used(0) {}
+    }; // struct slab_type
+
+    std::mutex mutex_;
+    size_type slab_size_;
+    size_type align_;
+    size_type bytes_;
+    CLContext context_;
+    std::map<::cl_mem_flags, slab_type> slab_;
+    std::map<key_type, std::vector<block_type>> free_;
+
+    CLMemoryPool()
+        : slab_size_(VSMC_OPENCL_MEMORY_POOL_SLAB), align_(256), bytes_(0)
+    {
+    }
+
+    void check_context()
+    {
+        if (context_.get() == manager().context().get())
+            return;
+
+        free_.clear();
+        slab_.clear();
+        bytes_ = 0;
+        context_ = manager().context();
+        align_ = 256;
+        for (const auto &dev : manager().device_vec()) {
+            ::cl_uint bits = 0;
+            dev.get_info(CL_DEVICE_MEM_BASE_ADDR_ALIGN, bits);
+            while (align_ * 8 < bits)
+                align_ <<= 1;
+        }
+    }
+
+    // Carve a new block of `b` bytes from the current slab of `flags`,
+    // starting a new slab if it is used up
+    CLMemory grow(size_type b, ::cl_mem_flags flags)
+    {
+        if (b * 2 > slab_size_ || manager().opencl_version() < 110) {
+            CLMemory mem(manager().template create_buffer<char>(b, flags));
+            if (bool(mem))
+                bytes_ += b;
+            return mem;
+        }
+
+        slab_type &slab = slab_[flags];
+        if (!bool(slab.mem) || slab.used + b > slab.size) {
+            const size_type size = slab_size_ / align_ * align_;
+            CLMemory mem(manager().template create_buffer<char>(size, flags));
+            if (!bool(mem))
+                return mem;
+            slab.mem = std::move(mem);
+            slab.size = size;
+            slab.used = 0;
+            bytes_ += size;
+        }
+
+        ::cl_buffer_region region;
+        region.origin = slab.used;
+        region.size = b;
+        CLMemory sub(
+            slab.mem.sub_buffer(0, CL_BUFFER_CREATE_TYPE_REGION, &region));
+        if (bool(sub))
+            slab.used += b;
+
+        return sub;
+    }
+
+    // Enqueue a marker on each queue of the manager, such that a released
+    // buffer is not handed out again while commands using it are pending
+    void fence(std::vector<CLEvent> &pending) const
+    {
+#if VSMC_OPENCL_VERSION >= 120
+        if (manager().opencl_version() >= 120) {
+            std::vector<const CLCommandQueue *> queues;
+            queues.push_back(&manager().command_queue());
+            queues.push_back(&manager().transfer_queue());
+            for (const auto &queue : manager().command_queue_vec())
+                queues.push_back(&queue);
+            for (std::size_t i = 0; i != queues.size(); ++i) {
+                bool seen = !bool(*queues[i]);
+                for (std::size_t j = 0; j != i; ++j)
+                    seen = seen || queues[j]->get() == queues[i]->get();
+                if (seen)
+                    continue;
+                CLEvent event;
+                if (queues[i]->enqueue_marker_with_wait_list(
+                        std::vector<CLEvent>(), event) == CL_SUCCESS) {
+                    queues[i]->flush();
+                    pending.push_back(std::move(event));
+                }
+            }
+            return;
+        }
+#endif
+        manager().finish();
+    }
+
+    static bool complete(const std::vector<CLEvent> &pending)
+    {
+        for (const auto &event : pending) {
+            ::cl_int status = CL_COMPLETE;
+            event.get_info(CL_EVENT_COMMAND_EXECUTION_STATUS, status);
+            if (status > CL_COMPLETE)
+                return false;
+        }
+
+        return true;
+    }
+}; // class CLMemoryPool
+
+} // namespace vsmc
+
+#endif // VSMC_OPENCL_CL_MEMORY_POOL_HPP
@@ -0,0 +1,458 @@
+//============================================================================
+// vSMC/include/vsmc/opencl/cl_program_cache.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_OPENCL_CL_PROGRAM_CACHE_HPP
+#define VSMC_OPENCL_CL_PROGRAM_CACHE_HPP
+
+#include <vsmc/opencl/internal/common.hpp>
+#include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_type.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+/// \brief Name of the environment variable of the program cache directory
+/// \ingroup Config
+#ifndef VSMC_OPENCL_PROGRAM_CACHE_ENV
+#define VSMC_OPENCL_PROGRAM_CACHE_ENV "VSMC_OPENCL_PROGRAM_CACHE"
+#endif
+
+namespace vsmc
+{
+
+namespace internal
+{
+
+/// \brief 64-bit FNV-1a hash
+class CLFNV1a
+{
+    public:
+    CLFNV1a() : hash_(0xCBF29CE484222325ULL) {}
+
+    void operator()(const std::string &str)
+    {
+        for (char c : str) {
+            hash_ ^= static_cast<unsigned char>(c);
+            hash_ *= 0x100000001B3ULL;
+        }
+        // Terminate each string such that ("ab", "c") != ("a", "bc")
+        hash_ ^= 0xFF;
+        hash_ *= 0x100000001B3ULL;
+    }
+
+    std::uint64_t hash() const { return hash_; }
+
+    private:
+    std::uint64_t hash_;
+}; // class CLFNV1a
+
+/// \brief The include directories given by `-I` in build options
+inline std::vector<std::string> cl_include_dirs(const std::string &options)
+{
+    std::vector<std::string> dirs;
+    std::stringstream ss(options);
+    std::string opt;
+    while (ss >> opt) {
+        if (opt.compare(0, 2, "-I") != 0)
+            continue;
+        if (opt.size() > 2)
+            dirs.push_back(opt.substr(2));
+        else if (ss >> opt)
+            dirs.push_back(opt);
+    }
+
+    return dirs;
+}
+
+/// \brief Hash the files included by a source, recursively
+///
+/// \details
+/// Each `#include` directive is resolved against the directory of the
+/// including file, for quoted names, and then against `dirs`. The path and
+/// the content of each file found are hashed once. The name of a file not
+/// found is hashed as is.
+inline void cl_include_hash(CLFNV1a &fnv, const std::string &source,
+    const std::string &parent, const std::vector<std::string> &dirs,
+    std::set<std::string> &visited)
+{
+    std::stringstream ss(source);
+    std::string line;
+    while (std::getline(ss, line)) {
+        std::size_t pos = line.find_first_not_of(" \t");
+        if (pos == std::string::npos || line[pos] != '#')
+            continue;
+        pos = line.find_first_not_of(" \t", pos + 1);
+        if (pos == std::string::npos || line.compare(pos, 7, "include") != 0)
+            continue;
+        pos = line.find_first_not_of(" \t", pos + 7);
+        if (pos == std::string::npos)
+            continue;
+        if (line[pos] != '<' && line[pos] != '"')
+            continue;
+        const char close = line[pos] == '<' ? '>' : '"';
+        const std::size_t end = line.find(close, pos + 1);
+        if (end == std::string::npos)
+            continue;
+        const std::string name(line.substr(pos + 1, end - pos - 1));
+
+        std::vector<std::string> search;
+        if (close == '"')
+            search.push_back(parent);
+        search.insert(search.end(), dirs.begin(), dirs.end());
+        bool found = false;
+        for (const auto &dir : search) {
+            const std::string path(dir.empty() ? name : dir + '/' + name);
+            std::ifstream is(path, std::ios_base::binary);
+            if (!is)
+                continue;
+            found = true;
+            if (!visited.insert(path).second)
+                break;
+            std::stringstream content;
+            content << is.rdbuf();
+            fnv(path);
+            fnv(content.str());
+            const std::size_t slash = path.find_last_of('/');
+            cl_include_hash(fnv, content.str(),
+                slash == std::string::npos ? std::string() :
+                                             path.substr(0, slash),
+                dirs, visited);
+            break;
+        }
+        if (!found)
+            fnv(name);
+    }
+}
+
+} // namespace vsmc::internal
+
+/// \brief Persistent on-disk cache of OpenCL program binaries
+/// \ingroup OpenCL
+///
+/// \details
+/// Each instance is a singleton for the CLManager with the same `ID`. The
+/// cache is disabled unless a directory is set, either by directory() or by
+/// the environment variable `VSMC_OPENCL_PROGRAM_CACHE`. The directory shall
+/// exist.
+///
+/// The key of a program is a hash of its source, the build options, the
+/// files it includes, and the platform version, name, vendor, version and
+/// driver version of each device in the context. A change of any of them
+/// results in a different entry, such that no explicit invalidation is
+/// needed. Included files are found by scanning the `#include` directives
+/// of the source and of each file found, against the directory of the
+/// including file and the `-I` directories in the options, see
+/// `internal::cl_include_hash`. Directives excluded by the preprocessor are
+/// hashed as well, which at worst results in a spurious rebuild. Headers
+/// found only through the default search path of the compiler are not
+/// hashed, and the cache shall be cleared when they change.
+///
+/// Entries are written to a temporary file and renamed, such that concurrent
+/// processes, e.g., ranks of an MPI job sharing a file system, never see
+/// partial files. If a cached binary fails to load or build, the program is
+/// built from source and the entry is replaced.
+///
+/// Note that the source built by StateCL includes the `SEED` macro. Runs
+/// with different seeds, or ranks with different global offsets, use
+/// different entries.
+template <typename ID = CLDefault>
+class CLProgramCache
+{
+    public:
+    using manager_type = CLManager<ID>;
+
+    CLProgramCache(const CLProgramCache<ID> &) = delete;
+
+    CLProgramCache<ID> &operator=(const CLProgramCache<ID> &) = delete;
+
+    static CLProgramCache<ID> &instance()
+    {
+        static CLProgramCache<ID> cache;
+
+        return cache;
+    }
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    /// \brief The cache directory, empty if the cache is disabled
+    const std::string &directory() const { return directory_; }
+
+    /// \brief Set the cache directory, empty to disable the cache
+    void directory(const std::string &dir) { directory_ = dir; }
+
+    /// \brief Whether the cache is enabled
+    bool enabled() const { return !directory_.empty(); }
+
+    /// \brief The file name of the cache entry of a given source and options
+    std::string file_name(
+        const std::string &source, const std::string &options) const
+    {
+        return file_name(directory_, source, options);
+    }
+
+    /// \brief The file name of the entry of a given source and options in a
+    /// given directory
+    std::string file_name(const std::string &dir, const std::string &source,
+        const std::string &options) const
+    {
+        std::stringstream ss;
+        ss << dir << '/' << "vsmc-" << std::hex << std::setw(16)
+           << std::setfill('0') << key(source, options) << ".clbin";
+
+        return ss.str();
+    }
+
+    /// \brief Create and build a program for all devices of the manager
+    ///
+    /// \details
+    /// If the cache is enabled and has an entry for the source and options,
+    /// the program is created from the cached binaries. Otherwise it is
+    /// created from the source, and its binaries are saved after a
+    /// successful build. `status` is the status of the final build.
+    CLProgram build(const std::string &source, const std::string &options,
+        ::cl_int &status)
+    {
+        const std::vector<CLDevice> &dev_vec = manager().device_vec();
+        if (enabled()) {
+            CLProgram program(load(directory_, source, options));
+            if (bool(program)) {
+                status = program.build(dev_vec, options);
+                if (status == CL_SUCCESS)
+                    return program;
+            }
+        }
+
+        CLProgram program(manager().create_program(source));
+        status = program.build(dev_vec, options);
+        if (status == CL_SUCCESS && enabled())
+            save(source, options, program);
+
+        return program;
+    }
+
+    /// \brief Create and build a program, trying binaries compiled ahead of
+    /// time first
+    ///
+    /// \details
+    /// The read-only directory `dir` is searched first for an entry of the
+    /// same source and options, e.g., one written by the `vsmc_cl_compile`
+    /// tool at build time (see `cmake/vSMCOpenCLCompile.cmake`). If there is
+    /// none, or it does not match the devices, this is the same as
+    /// `build(source, options, status)`.
+    CLProgram build(const std::string &dir, const std::string &source,
+        const std::string &options, ::cl_int &status)
+    {
+        if (!dir.empty()) {
+            CLProgram program(load(dir, source, options));
+            if (bool(program)) {
+                status = program.build(manager().device_vec(), options);
+                if (status == CL_SUCCESS)
+                    return program;
+            }
+        }
+
+        return build(source, options, status);
+    }
+
+    /// \brief Compile a module of a program with `clCompileProgram` for all
+    /// devices of the manager, without linking
+    ///
+    /// \details
+    /// Compiled modules are kept in memory for the lifetime of the context of
+    /// the manager. Compiling the same source with the same options again
+    /// returns the cached module. The modules can be linked with
+    /// `CLProgram(context, devices, options, modules)`. This requires OpenCL
+    /// 1.2.
+    CLProgram compile(const std::string &source, const std::string &options,
+        ::cl_int &status)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (module_context_.get() != manager().context().get()) {
+            module_.clear();
+            module_context_ = manager().context();
+        }
+
+        const std::uint64_t k = key(source, options);
+        auto iter = module_.find(k);
+        if (iter != module_.end()) {
+            status = CL_SUCCESS;
+            return iter->second;
+        }
+
+        CLProgram program(manager().create_program(source));
+        status = program.compile(manager().device_vec(), options,
+            std::vector<std::pair<CLProgram, std::string>>());
+        if (status == CL_SUCCESS)
+            module_[k] = program;
+
+        return program;
+    }
+
+    private:
+    std::string directory_;
+    std::mutex mutex_;
+    CLContext module_context_;
+    std::map<std::uint64_t, CLProgram> module_;
+
+    static constexpr std::uint64_t magic() { return 0x766D73434C42494EULL; }
+
+    CLProgramCache()
+    {
+        const char *dir = std::getenv(VSMC_OPENCL_PROGRAM_CACHE_ENV);
+        if (dir != nullptr)
+            directory_ = dir;
+    }
+
+    std::uint64_t key(
+        const std::string &source, const std::string &options) const
+    {
+        internal::CLFNV1a fnv;
+        fnv(source);
+        fnv(options);
+        std::set<std::string> visited;
+        internal::cl_include_hash(fnv, source, std::string(),
+            internal::cl_include_dirs(options), visited);
+
+        std::string info;
+        manager().platform().get_info(CL_PLATFORM_VERSION, info);
+        fnv(info);
+        for (const auto &dev : manager().device_vec()) {
+            dev.get_info(CL_DEVICE_NAME, info);
+            fnv(info);
+            dev.get_info(CL_DEVICE_VENDOR, info);
+            fnv(info);
+            dev.get_info(CL_DEVICE_VERSION, info);
+            fnv(info);
+            dev.get_info(CL_DRIVER_VERSION, info);
+            fnv(info);
+        }
+
+        return fnv.hash();
+    }
+
+    CLProgram load(const std::string &dir, const std::string &source,
+        const std::string &options)
+    {
+        const std::vector<CLDevice> &dev_vec = manager().device_vec();
+        std::ifstream is(
+            file_name(dir, source, options), std::ios_base::binary);
+        if (!is)
+            return CLProgram();
+
+        std::uint64_t header[3] = {0, 0, 0};
+        is.read(reinterpret_cast<char *>(header), sizeof(header));
+        if (!is || header[0] != magic() ||
+            header[1] != key(source, options) || header[2] != dev_vec.size())
+            return CLProgram();
+
+        std::vector<std::pair<CLDevice, std::vector<unsigned char>>> bins;
+        for (const auto &dev : dev_vec) {
+            std::uint64_t n = 0;
+            is.read(reinterpret_cast<char *>(&n), sizeof(n));
+            if (!is || n == 0)
+                return CLProgram();
+            std::vector<unsigned char> bin(static_cast<std::size_t>(n));
+            is.read(reinterpret_cast<char *>(bin.data()),
+                static_cast<std::streamsize>(n));
+            if (!is)
+                return CLProgram();
+            bins.push_back(std::make_pair(dev, std::move(bin)));
+        }
+
+        std::vector<::cl_int> binary_status;
+        CLProgram program(manager().context(), bins, binary_status);
+        for (auto s : binary_status)
+            if (s != CL_SUCCESS)
+                return CLProgram();
+
+        return program;
+    }
+
+    void save(const std::string &source, const std::string &options,
+        const CLProgram &program)
+    {
+        std::vector<std::size_t> sizes;
+        if (program.get_info(CL_PROGRAM_BINARY_SIZES, sizes) != CL_SUCCESS)
+            return;
+        if (sizes.size() != manager().device_vec().size())
+            return;
+
+        std::vector<std::vector<unsigned char>> bins(sizes.size());
+        std::vector<unsigned char *> ptrs;
+        for (std::size_t i = 0; i != sizes.size(); ++i) {
+            if (sizes[i] == 0)
+                return;
+            bins[i].resize(sizes[i]);
+            ptrs.push_back(bins[i].data());
+        }
+        ::cl_int status = CLProgram::get_info_param(program.get(),
+            CL_PROGRAM_BINARIES, sizeof(unsigned char *) * ptrs.size(),
+            ptrs.data(), nullptr);
+        if (status != CL_SUCCESS)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string name(file_name(source, options));
+        std::stringstream tmp;
+        tmp << name << '.'
+            << std::chrono::high_resolution_clock::now()
+                   .time_since_epoch()
+                   .count()
+            << '.' << reinterpret_cast<std::uintptr_t>(&tmp);
+        std::ofstream os(tmp.str(), std::ios_base::binary);
+        if (!os)
+            return;
+
+        std::uint64_t header[3] = {
+            magic(), key(source, options), sizes.size()};
+        os.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const auto &bin : bins) {
+            std::uint64_t n = bin.size();
+            os.write(reinterpret_cast<const char *>(&n), sizeof(n));
+            os.write(reinterpret_cast<const char *>(bin.data()),
+                static_cast<std::streamsize>(n));
+        }
+        os.close();
+        if (!os || std::rename(tmp.str().c_str(), name.c_str()) != 0)
+            std::remove(tmp.str().c_str());
+    }
+}; // class CLProgramCache
+
+} // namespace vsmc
+
+#endif // VSMC_OPENCL_CL_PROGRAM_CACHE_HPP
@@ -858,6 +858,36 @@ class CLProgram : public CLBase<::cl_program, CLProgram>
             reset(ptr);
     }
 
+    /// \brief `clLinkProgram`, keeping the program if linking fails
+    ///
+    /// \details
+    /// If the status is `CL_LINK_PROGRAM_FAILURE`, the program is still
+    /// created, such that the log of the link can be queried by
+    /// `build_log`
+    CLProgram(const CLContext &context, const std::vector<CLDevice> &devices,
+        const std::string &options,
+        const std::vector<CLProgram> &input_programs, ::cl_int &status)
+    {
+        std::vector<::cl_device_id> dptr;
+        for (const auto &dev : devices)
+            dptr.push_back(dev.get());
+
+        std::vector<::cl_program> pptr;
+        for (const auto &prg : input_programs)
+            pptr.push_back(prg.get());
+
+        status = CL_SUCCESS;
+        ::cl_program ptr = ::clLinkProgram(context.get(),
+            static_cast<::cl_uint>(dptr.size()), dptr.data(), options.c_str(),
+            static_cast<::cl_uint>(pptr.size()), pptr.data(), nullptr, nullptr,
+            &status);
+        internal::cl_error_check(
+            status, "CLProgram::CLProgram", "::clLinkProgram");
+
+        if (ptr != nullptr)
+            reset(ptr);
+    }
+
     /// \brief `clBuildProgram`
     ::cl_int build(
         const std::vector<CLDevice> &devices, const std::string &options) const
@@ -34,7 +34,9 @@
 
 #include <vsmc/opencl/internal/common.hpp>
 #include <vsmc/opencl/cl_configure.hpp>
+#include <vsmc/opencl/cl_layout.hpp>
 #include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
 #include <vsmc/opencl/cl_type.hpp>
 
 namespace vsmc
@@ -42,22 +44,45 @@ namespace vsmc
 namespace internal
 {
 
-template <typename ID>
+/// \brief Copy particle states on the device
+///
+/// \details
+/// With CLLayoutAoS, states are copied through the widest of `uint4`,
+/// `ulong`, `uint` and `uchar` that divides the state size, with one
+/// work-item per word such that neighbouring work-items access neighbouring
+/// words. With an interleaved layout, states are copied component by
+/// component, with neighbouring work-items copying the same component of
+/// neighbouring particles.
+///
+/// - `copy` takes `src_idx` of all particles and copies in place, skipping
+///   those with `src_idx[i] == i`. It requires that a particle which is the
+///   source of another is also its own source, as is the case for indices
+///   produced by the host resampling algorithms.
+/// - `copy_compact` takes only the `M` particles that change, as pairs of
+///   destination and source indices, and thus launches `M` particles worth
+///   of work-items instead of `N`. It has the same requirement as `copy`.
+/// - `copy_next` copies out of place into a second buffer of the same size,
+///   and works with any `src_idx`. The caller then swaps the two buffers.
+template <typename ID, typename Layout = CLLayoutAoS>
 class CLCopy
 {
     public:
     using manager_type = CLManager<ID>;
 
-    CLCopy() : size_(0) {}
+    CLCopy() : size_(0), word_size_(1), word_num_(0) {}
 
     std::size_t size() { return size_; }
 
+    /// \brief The size in bytes of the word through which states are copied
+    std::size_t word_size() const { return word_size_; }
+
     static manager_type &manager() { return manager_type::instance(); }
 
     void operator()(const CLMemory &src_idx, const CLMemory &state)
     {
         cl_set_kernel_args(kernel_, 0, src_idx, state);
-        manager().run_kernel(kernel_, size_, configure_.local_size());
+        manager().run_kernel(
+            kernel_, size_ * word_num_, configure_.local_size());
     }
 
     void operator()(
@@ -65,66 +90,203 @@ class CLCopy
     {
         cl_set_kernel_args(kernel_post_, 0, idx, tmp, state);
         manager().run_kernel(
-            kernel_post_, size_, configure_post_.local_size());
+            kernel_post_, size_ * word_num_, configure_post_.local_size());
+    }
+
+    void operator()(const CLMemory &src_idx, const CLMemory &state,
+        CLEvent &event, const std::vector<CLEvent> &event_wait_list =
+                            std::vector<CLEvent>())
+    {
+        cl_set_kernel_args(kernel_, 0, src_idx, state);
+        manager().enqueue_run_kernel(kernel_, size_ * word_num_, event,
+            configure_.local_size(), event_wait_list);
+    }
+
+    void operator()(const CLMemory &idx, const CLMemory &tmp,
+        const CLMemory &state, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        cl_set_kernel_args(kernel_post_, 0, idx, tmp, state);
+        manager().enqueue_run_kernel(kernel_post_, size_ * word_num_, event,
+            configure_post_.local_size(), event_wait_list);
+    }
+
+    /// \brief Copy `M` particles in place, given `2 * M` indices stored as
+    /// `dst_0, src_0, dst_1, src_1, ...`
+    void copy_compact(const CLMemory &pairs, std::size_t M,
+        const CLMemory &state, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        const ::cl_ulong m = static_cast<::cl_ulong>(M);
+        cl_set_kernel_args(kernel_compact_, 0, m, pairs, state);
+        manager().enqueue_run_kernel(kernel_compact_, M * word_num_, event,
+            configure_compact_.local_size(), event_wait_list);
+    }
+
+    /// \brief Copy all particles from `state` into `next`
+    void copy_next(const CLMemory &src_idx, const CLMemory &state,
+        const CLMemory &next, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        cl_set_kernel_args(kernel_next_, 0, src_idx, state, next);
+        manager().enqueue_run_kernel(kernel_next_, size_ * word_num_, event,
+            configure_next_.local_size(), event_wait_list);
     }
 
-    void build(std::size_t size, std::size_t state_size)
+    /// \brief Build the kernels
+    ///
+    /// \param size The number of particles
+    /// \param state_size The size in bytes of the state of a particle
+    /// \param component_size The size in bytes of a component, used by
+    /// interleaved layouts
+    void build(std::size_t size, std::size_t state_size,
+        std::size_t component_size = 1)
     {
         size_ = size;
 
+        const char *word_type = "uchar";
+        word_size_ = 1;
+        if (Layout::interleaved()) {
+            if (component_size == 8) {
+                word_type = "ulong";
+                word_size_ = 8;
+            } else if (component_size == 4) {
+                word_type = "uint";
+                word_size_ = 4;
+            }
+        } else if (state_size % 16 == 0) {
+            word_type = "uint4";
+            word_size_ = 16;
+        } else if (state_size % 8 == 0) {
+            word_type = "ulong";
+            word_size_ = 8;
+        } else if (state_size % 4 == 0) {
+            word_type = "uint";
+            word_size_ = 4;
+        }
+        word_num_ = state_size / word_size_;
+
         std::stringstream ss;
 
         ss << "#define Size " << size << "UL\n";
-        ss << "typedef struct {char c[" << state_size << "];} state_type;";
+        ss << "#define PaddedSize " << Layout::padded_size(size) << "UL\n";
+        ss << "#define WordNum " << word_num_ << "UL\n";
+        ss << "typedef " << word_type << " word_type;\n";
+        Layout::define(ss, "VSMC_COPY_LAYOUT");
+        ss << "#define VSMC_COPY_OFFSET(i, w) "
+              "VSMC_COPY_LAYOUT(i, w, PaddedSize, WordNum)\n";
+        if (Layout::interleaved()) {
+            ss << "#define VSMC_COPY_PARTICLE(id, m) ((id) % (m))\n";
+            ss << "#define VSMC_COPY_WORD(id, m) ((id) / (m))\n";
+        } else {
+            ss << "#define VSMC_COPY_PARTICLE(id, m) ((id) / WordNum)\n";
+            ss << "#define VSMC_COPY_WORD(id, m) ((id) % WordNum)\n";
+        }
 
         ss << "__kernel void copy (__global const ulong *src_idx,\n";
-        ss << "                    __global state_type *state)\n";
+        ss << "                    __global word_type *state)\n";
         ss << "{\n";
-        ss << "    ulong dst = get_global_id(0);\n";
-        ss << "    if (dst >= Size) return;\n";
+        ss << "    ulong id = get_global_id(0);\n";
+        ss << "    if (id >= Size * WordNum) return;\n";
+        ss << "    ulong dst = VSMC_COPY_PARTICLE(id, Size);\n";
+        ss << "    ulong w = VSMC_COPY_WORD(id, Size);\n";
         ss << "    ulong src = src_idx[dst];\n";
         ss << "    if (dst == src) return;\n";
-        ss << "    state[dst] = state[src];\n";
+        ss << "    state[VSMC_COPY_OFFSET(dst, w)] =\n";
+        ss << "        state[VSMC_COPY_OFFSET(src, w)];\n";
+        ss << "}\n";
+
+        ss << "__kernel void copy_compact (ulong m,\n";
+        ss << "                            __global const ulong *pairs,\n";
+        ss << "                            __global word_type *state)\n";
+        ss << "{\n";
+        ss << "    ulong id = get_global_id(0);\n";
+        ss << "    if (id >= m * WordNum) return;\n";
+        ss << "    ulong k = VSMC_COPY_PARTICLE(id, m);\n";
+        ss << "    ulong w = VSMC_COPY_WORD(id, m);\n";
+        ss << "    ulong dst = pairs[k * 2];\n";
+        ss << "    ulong src = pairs[k * 2 + 1];\n";
+        ss << "    state[VSMC_COPY_OFFSET(dst, w)] =\n";
+        ss << "        state[VSMC_COPY_OFFSET(src, w)];\n";
+        ss << "}\n";
+
+        ss << "__kernel void copy_next (__global const ulong *src_idx,\n";
+        ss << "                         __global const word_type *state,\n";
+        ss << "                         __global word_type *next)\n";
+        ss << "{\n";
+        ss << "    ulong id = get_global_id(0);\n";
+        ss << "    if (id >= Size * WordNum) return;\n";
+        ss << "    ulong dst = VSMC_COPY_PARTICLE(id, Size);\n";
+        ss << "    ulong w = VSMC_COPY_WORD(id, Size);\n";
+        ss << "    next[VSMC_COPY_OFFSET(dst, w)] =\n";
+        ss << "        state[VSMC_COPY_OFFSET(src_idx[dst], w)];\n";
         ss << "}\n";
 
         ss << "__kernel void copy_post (__global const char *idx,\n";
-        ss << "                         __global const state_type *tmp,\n";
-        ss << "                         __global state_type *state)\n";
+        ss << "                         __global const word_type *tmp,\n";
+        ss << "                         __global word_type *state)\n";
         ss << "{\n";
         ss << "    ulong id = get_global_id(0);\n";
-        ss << "    if (id >= Size) return;\n";
-        ss << "    if (idx[id] != 0) state[id] = tmp[id];\n";
+        ss << "    if (id >= Size * WordNum) return;\n";
+        ss << "    ulong i = VSMC_COPY_PARTICLE(id, Size);\n";
+        ss << "    ulong o = VSMC_COPY_OFFSET(i, VSMC_COPY_WORD(id, Size));\n";
+        ss << "    if (idx[i] != 0) state[o] = tmp[o];\n";
         ss << "}\n";
 
-        program_ = manager().create_program(ss.str());
-        program_.build(manager().device_vec(), std::string());
+        ::cl_int status = CL_SUCCESS;
+        program_ = CLProgramCache<ID>::instance().build(
+            ss.str(), std::string(), status);
 
         kernel_ = CLKernel(program_, "copy");
+        kernel_compact_ = CLKernel(program_, "copy_compact");
+        kernel_next_ = CLKernel(program_, "copy_next");
         kernel_post_ = CLKernel(program_, "copy_post");
 
-        configure_.local_size(size, kernel_, manager().device());
-        configure_post_.local_size(size, kernel_post_, manager().device());
+        const std::size_t N = size * word_num_;
+        configure_.local_size(N, kernel_, manager().device());
+        configure_compact_.local_size(N, kernel_compact_, manager().device());
+        configure_next_.local_size(N, kernel_next_, manager().device());
+        configure_post_.local_size(N, kernel_post_, manager().device());
     }
 
     const CLProgram &program() { return program_; }
 
     const CLKernel &kernel() { return kernel_; }
 
+    const CLKernel &kernel_compact() { return kernel_compact_; }
+
+    const CLKernel &kernel_next() { return kernel_next_; }
+
     const CLKernel &kernel_post() { return kernel_post_; }
 
     CLConfigure &configure() { return configure_; }
     const CLConfigure &configure() const { return configure_; }
 
-    CLConfigure &configure_post() { return configure_post; }
-    const CLConfigure &configure_post() const { return configure_post; }
+    CLConfigure &configure_compact() { return configure_compact_; }
+    const CLConfigure &configure_compact() const
+    {
+        return configure_compact_;
+    }
+
+    CLConfigure &configure_next() { return configure_next_; }
+    const CLConfigure &configure_next() const { return configure_next_; }
+
+    CLConfigure &configure_post() { return configure_post_; }
+    const CLConfigure &configure_post() const { return configure_post_; }
 
     private:
     std::size_t size_;
+    std::size_t word_size_;
+    std::size_t word_num_;
 
     CLProgram program_;
     CLKernel kernel_;
+    CLKernel kernel_compact_;
+    CLKernel kernel_next_;
     CLKernel kernel_post_;
     CLConfigure configure_;
+    CLConfigure configure_compact_;
+    CLConfigure configure_next_;
     CLConfigure configure_post_;
 }; // class CLCopy
 }
@@ -0,0 +1,269 @@
+//============================================================================
+// vSMC/include/vsmc/opencl/internal/cl_reduce.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_OPENCL_INTERNAL_REDUCE_HPP
+#define VSMC_OPENCL_INTERNAL_REDUCE_HPP
+
+#include <vsmc/opencl/internal/common.hpp>
+#include <vsmc/opencl/cl_buffer.hpp>
+#include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_manip.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
+#include <vsmc/opencl/cl_type.hpp>
+
+namespace vsmc
+{
+namespace internal
+{
+
+/// \brief Sum of a buffer of `ulong` on the device
+///
+/// \details
+/// The sum is computed in two stages. A fixed number of work-groups each
+/// reduce a strided part of the buffer, and then a single work-group
+/// reduces their partial sums. Only the final scalar is read back.
+template <typename ID>
+class CLReduce
+{
+    public:
+    using manager_type = CLManager<ID>;
+
+    CLReduce() : local_size_(0), group_num_(0) {}
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    ::cl_ulong operator()(const CLMemory &buf, std::size_t N,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        if (local_size_ == 0)
+            build();
+
+        const ::cl_ulong n = static_cast<::cl_ulong>(N);
+        const ::cl_ulong g = static_cast<::cl_ulong>(group_num_);
+        cl_set_kernel_args(kernel_, 0, n, buf, partial_buffer_.data());
+        manager().enqueue_run_kernel(kernel_, group_num_ * local_size_,
+            event_, local_size_, event_wait_list);
+        cl_set_kernel_args(
+            kernel_, 0, g, partial_buffer_.data(), result_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_, local_size_, event_, local_size_);
+
+        ::cl_ulong result = 0;
+        manager().read_buffer(result_buffer_.data(), 1, &result);
+
+        return result;
+    }
+
+    const CLProgram &program() { return program_; }
+
+    const CLKernel &kernel() { return kernel_; }
+
+    private:
+    std::size_t local_size_;
+    std::size_t group_num_;
+
+    CLBuffer<::cl_ulong, ID> partial_buffer_;
+    CLBuffer<::cl_ulong, ID> result_buffer_;
+    CLEvent event_;
+
+    CLProgram program_;
+    CLKernel kernel_;
+
+    void build()
+    {
+        // The size is only known when called, so use the most work-groups
+        local_size_ = cl_reduce_local_size(manager().device().get());
+        group_num_ = cl_reduce_group_num(
+            std::numeric_limits<std::size_t>::max(), local_size_);
+        partial_buffer_.resize(group_num_);
+        result_buffer_.resize(1);
+
+        std::stringstream ss;
+        cl_reduce_source(ss, local_size_);
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void reduce_sum (ulong n, __global const ulong *x,\n";
+        ss << "                 __global ulong *r)\n";
+        ss << "{\n";
+        ss << "    __local ulong buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    ulong a = 0;\n";
+        ss << "    for (ulong i = get_global_id(0); i < n;\n";
+        ss << "         i += get_global_size(0))\n";
+        ss << "        a += x[i];\n";
+        ss << "    buf[lid] = a;\n";
+        ss << "    VSMC_CL_REDUCE(buf[lid] += buf[lid + s])\n";
+        ss << "    if (lid == 0) r[get_group_id(0)] = buf[0];\n";
+        ss << "}\n";
+
+        ::cl_int status = CL_SUCCESS;
+        program_ = CLProgramCache<ID>::instance().build(
+            ss.str(), std::string(), status);
+
+        kernel_ = CLKernel(program_, "reduce_sum");
+    }
+}; // class CLReduce
+
+/// \brief Weighted sums of the rows of a buffer on the device
+///
+/// \details
+/// Given `n` log weights `lw`, and a row major `n` by `dim` buffer `x`, the
+/// sums of `exp(lw[i]) * x[i * dim + k]` for each `k`, and the sum of
+/// `exp(lw[i])`, are computed in two stages as by CLReduce. They are
+/// accumulated in `double` if all devices support it. Only `dim + 1`
+/// values are read back, and the weighted averages are written to `r`.
+template <typename RealType, typename ID>
+class CLWeightedSum
+{
+    public:
+    using manager_type = CLManager<ID>;
+
+    CLWeightedSum() : local_size_(0), group_num_(0), fp64_(false) {}
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    void operator()(std::size_t n, std::size_t dim, const CLMemory &lw,
+        const CLMemory &x, double *r,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        if (local_size_ == 0)
+            build();
+
+        const std::size_t acc_size =
+            fp64_ ? sizeof(double) : sizeof(RealType);
+        partial_buffer_.resize(group_num_ * (dim + 1) * acc_size);
+        result_buffer_.resize((dim + 1) * acc_size);
+
+        const ::cl_ulong N = static_cast<::cl_ulong>(n);
+        const ::cl_ulong d = static_cast<::cl_ulong>(dim);
+        const ::cl_ulong g = static_cast<::cl_ulong>(group_num_);
+        cl_set_kernel_args(kernel_, 0, N, d, lw, x, partial_buffer_.data());
+        manager().enqueue_run_kernel(kernel_, group_num_ * local_size_,
+            event_, local_size_, event_wait_list);
+        cl_set_kernel_args(kernel_post_, 0, g, d, partial_buffer_.data(),
+            result_buffer_.data());
+        manager().enqueue_run_kernel(
+            kernel_post_, local_size_, event_, local_size_);
+
+        result_.resize(dim + 1);
+        if (fp64_) {
+            manager().read_buffer(
+                result_buffer_.data(), dim + 1, result_.data());
+        } else {
+            host_.resize(dim + 1);
+            manager().read_buffer(
+                result_buffer_.data(), dim + 1, host_.data());
+            std::copy(host_.begin(), host_.end(), result_.begin());
+        }
+
+        const double coeff = 1 / result_[dim];
+        for (std::size_t k = 0; k != dim; ++k)
+            r[k] = result_[k] * coeff;
+    }
+
+    private:
+    std::size_t local_size_;
+    std::size_t group_num_;
+    bool fp64_;
+    std::vector<double> result_;
+    std::vector<RealType> host_;
+
+    CLBuffer<char, ID> partial_buffer_;
+    CLBuffer<char, ID> result_buffer_;
+    CLEvent event_;
+
+    CLProgram program_;
+    CLKernel kernel_;
+    CLKernel kernel_post_;
+
+    void build()
+    {
+        // The size is only known when called, so use the most work-groups
+        local_size_ = cl_reduce_local_size(manager().device().get());
+        group_num_ = cl_reduce_group_num(
+            std::numeric_limits<std::size_t>::max(), local_size_);
+        fp64_ = std::is_same<RealType, ::cl_double>::value ||
+            cl_has_fp64(manager().device_vec());
+
+        std::stringstream ss;
+        set_cl_fp_type<RealType>(ss);
+        set_cl_acc_type(ss, fp64_);
+        cl_reduce_source(ss, local_size_);
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void weighted_sum (ulong n, ulong dim,\n";
+        ss << "    __global const fp_type *lw, __global const fp_type *x,\n";
+        ss << "    __global acc_type *r)\n";
+        ss << "{\n";
+        ss << "    __local acc_type buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    for (ulong k = 0; k <= dim; ++k) {\n";
+        ss << "        acc_type a = 0;\n";
+        ss << "        for (ulong i = get_global_id(0); i < n;\n";
+        ss << "             i += get_global_size(0)) {\n";
+        ss << "            acc_type w = exp((acc_type) lw[i]);\n";
+        ss << "            a += k < dim ? w * x[i * dim + k] : w;\n";
+        ss << "        }\n";
+        ss << "        buf[lid] = a;\n";
+        ss << "        VSMC_CL_REDUCE(buf[lid] += buf[lid + s])\n";
+        ss << "        if (lid == 0)\n";
+        ss << "            r[get_group_id(0) * (dim + 1) + k] = buf[0];\n";
+        ss << "    }\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void weighted_sum_post (ulong n, ulong dim,\n";
+        ss << "    __global const acc_type *x, __global acc_type *r)\n";
+        ss << "{\n";
+        ss << "    __local acc_type buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    for (ulong k = 0; k <= dim; ++k) {\n";
+        ss << "        acc_type a = 0;\n";
+        ss << "        for (ulong i = lid; i < n; i += LocalSize)\n";
+        ss << "            a += x[i * (dim + 1) + k];\n";
+        ss << "        buf[lid] = a;\n";
+        ss << "        VSMC_CL_REDUCE(buf[lid] += buf[lid + s])\n";
+        ss << "        if (lid == 0) r[k] = buf[0];\n";
+        ss << "    }\n";
+        ss << "}\n";
+
+        ::cl_int status = CL_SUCCESS;
+        program_ = CLProgramCache<ID>::instance().build(
+            ss.str(), std::string(), status);
+
+        kernel_ = CLKernel(program_, "weighted_sum");
+        kernel_post_ = CLKernel(program_, "weighted_sum_post");
+    }
+}; // class CLWeightedSum
+}
+} // namespace vsmc::internal
+
+#endif // VSMC_OPENCL_INTERNAL_REDUCE_HPP
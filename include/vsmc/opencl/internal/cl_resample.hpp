@@ -0,0 +1,340 @@
+//============================================================================
+// vSMC/include/vsmc/opencl/internal/cl_resample.hpp
+//----------------------------------------------------------------------------
+//                         vSMC: Scalable Monte Carlo
+//----------------------------------------------------------------------------
+// Copyright (c) 2013-2015, Yan Zhou
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+//
+//   Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS AS IS
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+//============================================================================
+
+#ifndef VSMC_OPENCL_INTERNAL_RESAMPLE_HPP
+#define VSMC_OPENCL_INTERNAL_RESAMPLE_HPP
+
+#include <vsmc/opencl/internal/common.hpp>
+#include <vsmc/opencl/cl_buffer.hpp>
+#include <vsmc/opencl/cl_manager.hpp>
+#include <vsmc/opencl/cl_manip.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
+#include <vsmc/opencl/cl_type.hpp>
+
+namespace vsmc
+{
+namespace internal
+{
+
+/// \brief Resampling on the device
+///
+/// \details
+/// The weights are `exp` of the log weights, which are expected to be
+/// shifted such that their maximum is zero, as done by `WeightCL`. Their
+/// inclusive prefix sums are computed with a three stage scan, and each
+/// offspring finds its parent by a binary search of its draw. The residual
+/// schemes scan the integer and fractional parts of `N * W` in the same way.
+/// The prefix sums and the uniforms are in `double` if all devices support
+/// it. Otherwise they are in `fp_type`, and with `cl_float`, weights smaller
+/// than about `2^-24` of their running sum are partly lost by rounding, which
+/// biases the draws when `N` is of that order or the weights are uneven.
+/// Uniforms are generated by hashing the seed and the index of the
+/// offspring. The parent indices are written to `src_idx`, in the layout
+/// expected by `CLCopy`.
+template <typename RealType, typename ID>
+class CLResample
+{
+    public:
+    using manager_type = CLManager<ID>;
+
+    CLResample() : size_(0), local_size_(0), group_num_(0), fp64_(false) {}
+
+    std::size_t size() const { return size_; }
+
+    static manager_type &manager() { return manager_type::instance(); }
+
+    void operator()(ResampleScheme scheme, const CLMemory &log_weight,
+        const CLMemory &src_idx, ::cl_ulong seed, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>())
+    {
+        ::cl_ulong mode = 0;
+        switch (scheme) {
+            case Multinomial:
+            case Residual: mode = 0; break;
+            case Stratified:
+            case ResidualStratified: mode = 1; break;
+            case Systematic:
+            case ResidualSystematic: mode = 2; break;
+        }
+        const ::cl_ulong residual =
+            (scheme == Residual || scheme == ResidualStratified ||
+                scheme == ResidualSystematic) ?
+            1 :
+            0;
+
+        cl_set_kernel_args(kernel_weight_, 0, log_weight, weight_.data());
+        run(kernel_weight_, size_, event, event_wait_list);
+        scan(kernel_scan_fp_, kernel_scan_sums_fp_, kernel_scan_add_fp_,
+            weight_.data(), cdf_.data(), sums_fp_.data(), event);
+        if (residual != 0) {
+            cl_set_kernel_args(kernel_residual_, 0, weight_.data(),
+                cdf_.data(), count_.data(), weight_.data());
+            run(kernel_residual_, size_, event);
+            scan(kernel_scan_ul_, kernel_scan_sums_ul_, kernel_scan_add_ul_,
+                count_.data(), offset_.data(), sums_ul_.data(), event);
+            scan(kernel_scan_fp_, kernel_scan_sums_fp_, kernel_scan_add_fp_,
+                weight_.data(), cdf_.data(), sums_fp_.data(), event);
+            cl_set_kernel_args(kernel_residual_fill_, 0, count_.data(),
+                offset_.data(), src_idx);
+            run(kernel_residual_fill_, size_, event);
+        }
+        cl_set_kernel_args(kernel_draw_, 0, mode, residual, seed,
+            cdf_.data(), offset_.data(), src_idx);
+        run(kernel_draw_, size_, event);
+    }
+
+    void build(std::size_t size)
+    {
+        size_ = size;
+
+        local_size_ = cl_reduce_local_size(manager().device().get());
+        group_num_ = (size_ + local_size_ - 1) / local_size_;
+        fp64_ = std::is_same<RealType, ::cl_double>::value ||
+            cl_has_fp64(manager().device_vec());
+        const std::size_t acc_size =
+            fp64_ ? sizeof(double) : sizeof(RealType);
+
+        weight_.resize(size_);
+        cdf_.resize(size_ * acc_size);
+        count_.resize(size_);
+        offset_.resize(size_);
+        sums_fp_.resize(group_num_ * acc_size);
+        sums_ul_.resize(group_num_);
+
+        std::stringstream ss;
+        set_cl_fp_type<RealType>(ss);
+        set_cl_acc_type(ss, fp64_);
+        ss << "#define Size " << size_ << "UL\n";
+        ss << "#define Groups " << group_num_ << "UL\n";
+        cl_reduce_source(ss, local_size_);
+
+        ss << "acc_type resample_u01 (ulong seed, ulong j)\n";
+        ss << "{\n";
+        ss << "    ulong z = seed + (j + 1) * 0x9E3779B97F4A7C15UL;\n";
+        ss << "    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;\n";
+        ss << "    z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;\n";
+        ss << "    z = z ^ (z >> 31);\n";
+        if (fp64_)
+            ss << "    return (z >> 11) * 0x1.0p-53;\n";
+        else
+            ss << "    return (z >> 40) * 0x1.0p-24f;\n";
+        ss << "}\n";
+
+        ss << "__kernel void resample_weight (__global const fp_type *lw,\n";
+        ss << "                               __global fp_type *w)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i < Size) w[i] = exp(lw[i]);\n";
+        ss << "}\n";
+
+        scan_source(ss, "fp", "fp_type", "acc_type");
+        scan_source(ss, "ul", "ulong", "ulong");
+
+        ss << "__kernel void resample_residual (\n";
+        ss << "    __global const fp_type *w, __global const acc_type *cdf,\n";
+        ss << "    __global ulong *count, __global fp_type *resid)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i >= Size) return;\n";
+        ss << "    acc_type v = Size * (acc_type) w[i] / cdf[Size - 1];\n";
+        ss << "    acc_type c = floor(v);\n";
+        ss << "    count[i] = (ulong) c;\n";
+        ss << "    resid[i] = (fp_type) (v - c);\n";
+        ss << "}\n";
+
+        ss << "__kernel void resample_residual_fill (\n";
+        ss << "    __global const ulong *count,\n";
+        ss << "    __global const ulong *offset,\n";
+        ss << "    __global ulong *src_idx)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    if (i >= Size) return;\n";
+        ss << "    ulong first = offset[i] - count[i];\n";
+        ss << "    for (ulong k = first; k < offset[i] && k < Size; ++k)\n";
+        ss << "        src_idx[k] = i;\n";
+        ss << "}\n";
+
+        ss << "__kernel void resample_draw (ulong mode, ulong residual,\n";
+        ss << "    ulong seed, __global const acc_type *cdf,\n";
+        ss << "    __global const ulong *offset, __global ulong *src_idx)\n";
+        ss << "{\n";
+        ss << "    ulong j = get_global_id(0);\n";
+        ss << "    if (j >= Size) return;\n";
+        ss << "    ulong first = residual ? offset[Size - 1] : 0;\n";
+        ss << "    if (j < first) return;\n";
+        ss << "    acc_type k = j - first;\n";
+        ss << "    acc_type r = Size - first;\n";
+        ss << "    acc_type u = 0;\n";
+        ss << "    if (mode == 0) u = resample_u01(seed, j);\n";
+        ss << "    else if (mode == 1) u = (k + resample_u01(seed, j)) / r;\n";
+        ss << "    else u = (k + resample_u01(seed, 0)) / r;\n";
+        ss << "    acc_type p = u * cdf[Size - 1];\n";
+        ss << "    ulong lo = 0;\n";
+        ss << "    ulong hi = Size - 1;\n";
+        ss << "    while (lo < hi) {\n";
+        ss << "        ulong mid = lo + (hi - lo) / 2;\n";
+        ss << "        if (cdf[mid] > p) hi = mid; else lo = mid + 1;\n";
+        ss << "    }\n";
+        ss << "    src_idx[j] = lo;\n";
+        ss << "}\n";
+
+        ::cl_int status = CL_SUCCESS;
+        program_ = CLProgramCache<ID>::instance().build(
+            ss.str(), std::string(), status);
+
+        kernel_weight_ = CLKernel(program_, "resample_weight");
+        kernel_scan_fp_ = CLKernel(program_, "resample_scan_fp");
+        kernel_scan_sums_fp_ = CLKernel(program_, "resample_scan_sums_fp");
+        kernel_scan_add_fp_ = CLKernel(program_, "resample_scan_add_fp");
+        kernel_scan_ul_ = CLKernel(program_, "resample_scan_ul");
+        kernel_scan_sums_ul_ = CLKernel(program_, "resample_scan_sums_ul");
+        kernel_scan_add_ul_ = CLKernel(program_, "resample_scan_add_ul");
+        kernel_residual_ = CLKernel(program_, "resample_residual");
+        kernel_residual_fill_ = CLKernel(program_, "resample_residual_fill");
+        kernel_draw_ = CLKernel(program_, "resample_draw");
+    }
+
+    const CLProgram &program() { return program_; }
+
+    private:
+    std::size_t size_;
+    std::size_t local_size_;
+    std::size_t group_num_;
+    bool fp64_;
+
+    CLBuffer<RealType, ID> weight_;
+    CLBuffer<char, ID> cdf_;
+    CLBuffer<::cl_ulong, ID> count_;
+    CLBuffer<::cl_ulong, ID> offset_;
+    CLBuffer<char, ID> sums_fp_;
+    CLBuffer<::cl_ulong, ID> sums_ul_;
+
+    CLProgram program_;
+    CLKernel kernel_weight_;
+    CLKernel kernel_scan_fp_;
+    CLKernel kernel_scan_sums_fp_;
+    CLKernel kernel_scan_add_fp_;
+    CLKernel kernel_scan_ul_;
+    CLKernel kernel_scan_sums_ul_;
+    CLKernel kernel_scan_add_ul_;
+    CLKernel kernel_residual_;
+    CLKernel kernel_residual_fill_;
+    CLKernel kernel_draw_;
+
+    void run(const CLKernel &kern, std::size_t N, CLEvent &event,
+        const std::vector<CLEvent> &event_wait_list = std::vector<CLEvent>(),
+        std::size_t local_size = 0)
+    {
+        manager().enqueue_run_kernel(
+            kern, N, event, local_size, event_wait_list);
+    }
+
+    // Inclusive scan of x into y, a scan within each work-group, then of the
+    // work-group sums by a single work-group, and finally the addition of
+    // the sums of the preceding work-groups
+    void scan(const CLKernel &kern, const CLKernel &kern_sums,
+        const CLKernel &kern_add, const CLMemory &x, const CLMemory &y,
+        const CLMemory &sums, CLEvent &event)
+    {
+        const std::size_t global_size = group_num_ * local_size_;
+        cl_set_kernel_args(kern, 0, x, y, sums);
+        run(kern, global_size, event, std::vector<CLEvent>(), local_size_);
+        cl_set_kernel_args(kern_sums, 0, sums);
+        run(kern_sums, local_size_, event, std::vector<CLEvent>(),
+            local_size_);
+        cl_set_kernel_args(kern_add, 0, y, sums);
+        run(kern_add, global_size, event, std::vector<CLEvent>(),
+            local_size_);
+    }
+
+    // The scan of `in_type` values, accumulated and written as `type`
+    static void scan_source(std::stringstream &ss, const char *name,
+        const char *in_type, const char *type)
+    {
+        ss << "#define VSMC_RESAMPLE_SCAN_LOCAL(buf, T)\\\n";
+        ss << "    barrier(CLK_LOCAL_MEM_FENCE);\\\n";
+        ss << "    for (size_t s = 1; s < LocalSize; s <<= 1) {\\\n";
+        ss << "        T v = lid >= s ? buf[lid - s] : 0;\\\n";
+        ss << "        barrier(CLK_LOCAL_MEM_FENCE);\\\n";
+        ss << "        buf[lid] += v;\\\n";
+        ss << "        barrier(CLK_LOCAL_MEM_FENCE);\\\n";
+        ss << "    }\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void resample_scan_" << name << " (__global const "
+           << in_type << " *x,\n";
+        ss << "    __global " << type << " *y, __global " << type
+           << " *sums)\n";
+        ss << "{\n";
+        ss << "    __local " << type << " buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    buf[lid] = i < Size ? x[i] : 0;\n";
+        ss << "    VSMC_RESAMPLE_SCAN_LOCAL(buf, " << type << ")\n";
+        ss << "    if (i < Size) y[i] = buf[lid];\n";
+        ss << "    if (lid == LocalSize - 1)\n";
+        ss << "        sums[get_group_id(0)] = buf[lid];\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void resample_scan_sums_" << name << " (__global " << type
+           << " *sums)\n";
+        ss << "{\n";
+        ss << "    __local " << type << " buf[LocalSize];\n";
+        ss << "    size_t lid = get_local_id(0);\n";
+        ss << "    " << type << " carry = 0;\n";
+        ss << "    for (ulong b = 0; b < Groups; b += LocalSize) {\n";
+        ss << "        ulong i = b + lid;\n";
+        ss << "        buf[lid] = i < Groups ? sums[i] : 0;\n";
+        ss << "        VSMC_RESAMPLE_SCAN_LOCAL(buf, " << type << ")\n";
+        ss << "        if (i < Groups) sums[i] = buf[lid] + carry;\n";
+        ss << "        carry += buf[LocalSize - 1];\n";
+        ss << "        barrier(CLK_LOCAL_MEM_FENCE);\n";
+        ss << "    }\n";
+        ss << "}\n";
+
+        ss << "__kernel ReqdSize\n";
+        ss << "void resample_scan_add_" << name << " (__global " << type
+           << " *y,\n";
+        ss << "    __global const " << type << " *sums)\n";
+        ss << "{\n";
+        ss << "    ulong i = get_global_id(0);\n";
+        ss << "    size_t g = get_group_id(0);\n";
+        ss << "    if (i < Size && g > 0) y[i] += sums[g - 1];\n";
+        ss << "}\n";
+
+        ss << "#undef VSMC_RESAMPLE_SCAN_LOCAL\n";
+    }
+}; // class CLResample
+}
+} // namespace vsmc::internal
+
+#endif // VSMC_OPENCL_INTERNAL_RESAMPLE_HPP
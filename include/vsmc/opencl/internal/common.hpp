@@ -113,6 +113,131 @@ inline int cl_opencl_c_version(::cl_device_id device)
     return status == CL_SUCCESS ? cl_version(version + 9) : 100;
 }
 
+/// \brief Whether all devices support double precision
+///
+/// \details
+/// `DeviceVec` is a container of CLDevice objects
+template <typename DeviceVec>
+inline bool cl_has_fp64(const DeviceVec &dev_vec)
+{
+    for (const auto &dev : dev_vec) {
+        ::cl_device_fp_config config = 0;
+        ::cl_int status = ::clGetDeviceInfo(dev.get(),
+            CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(config), &config, nullptr);
+        if (status != CL_SUCCESS || config == 0)
+            return false;
+    }
+
+    return true;
+}
+
+/// \brief Write the type `acc_type` of reduction sums to an OpenCL source
+///
+/// \details
+/// It is `double` if `fp64` is true, and `fp_type` otherwise. The host reads
+/// the sums as `double` or `RealType` accordingly
+inline void set_cl_acc_type(std::stringstream &ss, bool fp64)
+{
+    if (!fp64) {
+        ss << "typedef fp_type acc_type;\n";
+        return;
+    }
+
+    ss << "#if defined(cl_khr_fp64)\n";
+    ss << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+    ss << "#elif defined(cl_amd_fp64)\n";
+    ss << "#pragma OPENCL EXTENSION cl_amd_fp64 : enable\n";
+    ss << "#endif\n";
+    ss << "typedef double acc_type;\n";
+}
+
+/// \brief The local size of work-group reductions and scans on a device
+///
+/// \details
+/// The largest power of two no larger than `CL_DEVICE_MAX_WORK_GROUP_SIZE`
+/// and 256, such that each step of a reduction halves the active work-items
+inline std::size_t cl_reduce_local_size(::cl_device_id device)
+{
+    std::size_t lmax = 0;
+    ::clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+        sizeof(std::size_t), &lmax, nullptr);
+    lmax = std::min<std::size_t>(lmax, 256);
+    std::size_t local_size = 1;
+    while (local_size * 2 <= lmax)
+        local_size *= 2;
+
+    return local_size;
+}
+
+/// \brief The number of work-groups of a reduction of `n` elements
+///
+/// \details
+/// Enough work-groups to give each work-item one element, but at least one
+/// and at most 64, such that the partial results are few enough to be
+/// reduced by a single work-group
+inline std::size_t cl_reduce_group_num(std::size_t n, std::size_t local_size)
+{
+    std::size_t group_num = n / local_size + (n % local_size == 0 ? 0 : 1);
+    group_num = std::max<std::size_t>(group_num, 1);
+    group_num = std::min<std::size_t>(group_num, 64);
+
+    return group_num;
+}
+
+/// \brief Write the macros of work-group reductions to an OpenCL source
+///
+/// \details
+/// `LocalSize` is the local size, `ReqdSize` the attribute requiring it,
+/// and `VSMC_CL_REDUCE(op)` a tree reduction of `__local` buffers indexed by
+/// `lid`, where `op` combines element `lid` with element `lid + s`
+inline void cl_reduce_source(std::stringstream &ss, std::size_t local_size)
+{
+    ss << "#define LocalSize " << local_size << "UL\n";
+    ss << "#define ReqdSize "
+          "__attribute__((reqd_work_group_size(LocalSize, 1, 1)))\n";
+    ss << "#define VSMC_CL_REDUCE(op)\\\n";
+    ss << "    barrier(CLK_LOCAL_MEM_FENCE);\\\n";
+    ss << "    for (size_t s = LocalSize / 2; s > 0; s >>= 1) {\\\n";
+    ss << "        if (lid < s) op;\\\n";
+    ss << "        barrier(CLK_LOCAL_MEM_FENCE);\\\n";
+    ss << "    }\n";
+}
+
+template <typename>
+void set_cl_fp_type(std::stringstream &);
+
+template <>
+inline void set_cl_fp_type<cl_float>(std::stringstream &ss)
+{
+    ss << "#ifndef FP_TYPE\n";
+    ss << "#define FP_TYPE float\n";
+    ss << "typedef float fp_type;\n";
+    ss << "#endif\n";
+
+    ss << "#ifndef VSMC_HAS_RNGC_DOUBLE\n";
+    ss << "#define VSMC_HAS_RNGC_DOUBLE 0\n";
+    ss << "#endif\n";
+}
+
+template <>
+inline void set_cl_fp_type<cl_double>(std::stringstream &ss)
+{
+    ss << "#if defined(cl_khr_fp64)\n";
+    ss << "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+    ss << "#elif defined(cl_amd_fp64)\n";
+    ss << "#pragma OPENCL EXTENSION cl_amd_fp64 : enable\n";
+    ss << "#endif\n";
+
+    ss << "#ifndef FP_TYPE\n";
+    ss << "#define FP_TYPE double\n";
+    ss << "typedef double fp_type;\n";
+    ss << "#endif\n";
+
+    ss << "#ifndef VSMC_HAS_RNGC_DOUBLE\n";
+    ss << "#define VSMC_HAS_RNGC_DOUBLE 1\n";
+    ss << "#endif\n";
+}
+
 } // namespace vsmc::internal
 
 /// \brief Template parameter type for default behavior
@@ -36,8 +36,11 @@
 #include <vsmc/opencl/backend_cl.hpp>
 #include <vsmc/opencl/cl_buffer.hpp>
 #include <vsmc/opencl/cl_configure.hpp>
+#include <vsmc/opencl/cl_layout.hpp>
 #include <vsmc/opencl/cl_manager.hpp>
 #include <vsmc/opencl/cl_manip.hpp>
+#include <vsmc/opencl/cl_memory_pool.hpp>
+#include <vsmc/opencl/cl_program_cache.hpp>
 #include <vsmc/opencl/cl_query.hpp>
 #include <vsmc/opencl/cl_setup.hpp>
 #include <vsmc/opencl/cl_type.hpp>